@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2023 - 2025 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Growable byte buffers for Lua */
+
+#include <errno.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "luabuffer.h"
+
+static struct buffer *
+buffer_check(lua_State *L, int n)
+{
+	struct buffer *b;
+
+	b = luaL_checkudata(L, n, BUFFER_METATABLE);
+	if (b->data == NULL)
+		luaL_error(L, "attempt to use a closed buffer");
+	return b;
+}
+
+/* Check for a buffer that may be modified */
+static struct buffer *
+buffer_checkrw(lua_State *L, int n)
+{
+	struct buffer *b;
+
+	b = buffer_check(L, n);
+	if (b->pins > 0)
+		luaL_error(L, "attempt to modify a buffer that is being sent");
+	return b;
+}
+
+/* Translate a negative position relative to the end, as string.sub() */
+static lua_Integer
+buffer_posrelat(lua_Integer pos, size_t len)
+{
+	if (pos >= 0)
+		return pos;
+	if ((size_t)-pos > len)
+		return 0;
+	return (lua_Integer)len + pos + 1;
+}
+
+static int
+linux_buffer_new(lua_State *L)
+{
+	struct buffer *b;
+	const char *s = NULL;
+	size_t len = 0, size;
+	lua_Integer n;
+
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		s = lua_tolstring(L, 1, &len);
+		size = len > BUFFER_SIZE ? len : BUFFER_SIZE;
+	} else {
+		n = luaL_optinteger(L, 1, BUFFER_SIZE);
+		luaL_argcheck(L, n >= 0, 1, "negative size");
+		size = n;
+	}
+	if (size == 0)
+		size = BUFFER_SIZE;
+
+	b = lua_newuserdatauv(L, sizeof(struct buffer), 0);
+	b->data = NULL;
+	b->size = b->len = 0;
+	b->pins = 0;
+	luaL_setmetatable(L, BUFFER_METATABLE);
+
+	b->data = malloc(size);
+	if (b->data == NULL)
+		return luaL_error(L, "memory error");
+	b->size = size;
+	if (s != NULL) {
+		memcpy(b->data, s, len);
+		b->len = len;
+	}
+	return 1;
+}
+
+/* Append strings and the contents of other buffers */
+static int
+linux_buffer_append(lua_State *L)
+{
+	struct buffer *b, *src;
+	const char *s;
+	size_t len;
+	int n, top;
+
+	b = buffer_checkrw(L, 1);
+	top = lua_gettop(L);
+	for (n = 2; n <= top; n++) {
+		if ((src = luaL_testudata(L, n, BUFFER_METATABLE)) != NULL) {
+			if (src->data == NULL)
+				return luaL_argerror(L, n, "closed buffer");
+			if (buffer_reserve(b, src->len))
+				return luaL_error(L, "memory error");
+			memmove(b->data + b->len, src->data, src->len);
+			b->len += src->len;
+		} else {
+			s = luaL_checklstring(L, n, &len);
+			if (buffer_reserve(b, len))
+				return luaL_error(L, "memory error");
+			memcpy(b->data + b->len, s, len);
+			b->len += len;
+		}
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int
+linux_buffer_len(lua_State *L)
+{
+	lua_pushinteger(L, buffer_check(L, 1)->len);
+	return 1;
+}
+
+static int
+linux_buffer_capacity(lua_State *L)
+{
+	lua_pushinteger(L, buffer_check(L, 1)->size);
+	return 1;
+}
+
+/* Make room for at least n more bytes without further allocations */
+static int
+linux_buffer_reserve(lua_State *L)
+{
+	struct buffer *b;
+	lua_Integer n;
+
+	b = buffer_checkrw(L, 1);
+	n = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, n >= 0, 2, "negative length");
+	if (buffer_reserve(b, n))
+		return luaL_error(L, "memory error");
+	return 0;
+}
+
+/* Bytes i to j as a string, with the index rules of string.sub() */
+static int
+linux_buffer_sub(lua_State *L)
+{
+	struct buffer *b;
+	lua_Integer i, j;
+
+	b = buffer_check(L, 1);
+	i = buffer_posrelat(luaL_optinteger(L, 2, 1), b->len);
+	j = buffer_posrelat(luaL_optinteger(L, 3, -1), b->len);
+	if (i < 1)
+		i = 1;
+	if (j > (lua_Integer)b->len)
+		j = b->len;
+	if (i > j)
+		lua_pushliteral(L, "");
+	else
+		lua_pushlstring(L, b->data + i - 1, j - i + 1);
+	return 1;
+}
+
+static int
+linux_buffer_tostring(lua_State *L)
+{
+	struct buffer *b;
+
+	b = luaL_checkudata(L, 1, BUFFER_METATABLE);
+	lua_pushlstring(L, b->data != NULL ? b->data : "", b->len);
+	return 1;
+}
+
+static int
+linux_buffer_byte(lua_State *L)
+{
+	struct buffer *b;
+	lua_Integer i;
+
+	b = buffer_check(L, 1);
+	i = buffer_posrelat(luaL_optinteger(L, 2, 1), b->len);
+	if (i < 1 || i > (lua_Integer)b->len)
+		return 0;
+	lua_pushinteger(L, (unsigned char)b->data[i - 1]);
+	return 1;
+}
+
+/* Plain search for a string, returns the first and last position */
+static int
+linux_buffer_find(lua_State *L)
+{
+	struct buffer *b;
+	const char *needle, *p;
+	lua_Integer init;
+	size_t len;
+
+	b = buffer_check(L, 1);
+	needle = luaL_checklstring(L, 2, &len);
+	init = buffer_posrelat(luaL_optinteger(L, 3, 1), b->len);
+	if (init < 1)
+		init = 1;
+	if (init > (lua_Integer)b->len + 1) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	p = memmem(b->data + init - 1, b->len - init + 1, needle, len);
+	if (p == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, p - b->data + 1);
+	lua_pushinteger(L, p - b->data + len);
+	return 2;
+}
+
+/* Remove n bytes from the front */
+static int
+linux_buffer_consume(lua_State *L)
+{
+	struct buffer *b;
+	lua_Integer n;
+
+	b = buffer_checkrw(L, 1);
+	n = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, n >= 0, 2, "negative length");
+
+	if ((size_t)n >= b->len)
+		b->len = 0;
+	else {
+		memmove(b->data, b->data + n, b->len - n);
+		b->len -= n;
+	}
+	return 0;
+}
+
+/* Keep the first n bytes */
+static int
+linux_buffer_truncate(lua_State *L)
+{
+	struct buffer *b;
+	lua_Integer n;
+
+	b = buffer_checkrw(L, 1);
+	n = luaL_optinteger(L, 2, 0);
+	luaL_argcheck(L, n >= 0, 2, "negative length");
+
+	if ((size_t)n < b->len)
+		b->len = n;
+	return 0;
+}
+
+static int
+linux_buffer_close(lua_State *L)
+{
+	struct buffer *b;
+
+	b = luaL_checkudata(L, 1, BUFFER_METATABLE);
+	if (b->pins > 0)
+		return luaL_error(L, "attempt to close a buffer that is being "
+		    "sent");
+	free(b->data);
+	b->data = NULL;
+	b->size = b->len = 0;
+	return 0;
+}
+
+/* A collected buffer is no longer referenced by any socket */
+static int
+linux_buffer_gc(lua_State *L)
+{
+	struct buffer *b;
+
+	b = luaL_checkudata(L, 1, BUFFER_METATABLE);
+	free(b->data);
+	b->data = NULL;
+	b->size = b->len = 0;
+	return 0;
+}
+
+int
+luaopen_linux_buffer(lua_State *L)
+{
+	struct luaL_Reg lualinuxbuffer[] = {
+		{ "new",	linux_buffer_new },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg buffer_methods[] = {
+		{ "append",	linux_buffer_append },
+		{ "len",	linux_buffer_len },
+		{ "capacity",	linux_buffer_capacity },
+		{ "reserve",	linux_buffer_reserve },
+		{ "sub",	linux_buffer_sub },
+		{ "tostring",	linux_buffer_tostring },
+		{ "byte",	linux_buffer_byte },
+		{ "find",	linux_buffer_find },
+		{ "consume",	linux_buffer_consume },
+		{ "truncate",	linux_buffer_truncate },
+		{ "close",	linux_buffer_close },
+		{ NULL, NULL }
+	};
+
+	if (luaL_newmetatable(L, BUFFER_METATABLE)) {
+		luaL_setfuncs(L, buffer_methods, 0);
+
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, linux_buffer_gc);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__close");
+		lua_pushcfunction(L, linux_buffer_close);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__len");
+		lua_pushcfunction(L, linux_buffer_len);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__tostring");
+		lua_pushcfunction(L, linux_buffer_tostring);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	luaL_newlib(L, lualinuxbuffer);
+	return 1;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2023 - 2025 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Growable byte buffers for Lua */
+
+#ifndef __LUABUFFER_H__
+#define __LUABUFFER_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define BUFFER_METATABLE	"byte buffer"
+
+/* Default initial capacity */
+#define BUFFER_SIZE		4096
+
+/*
+ * The bytes of a buffer are data[0] to data[len - 1].  Other modules
+ * append to a buffer by making room with realloc() and advancing len.
+ * A buffer with pins > 0 is being sent with MSG_ZEROCOPY and must not
+ * be modified or reallocated.
+ */
+struct buffer {
+	char	*data;
+	size_t	 size;		/* allocated */
+	size_t	 len;		/* used */
+	int	 pins;		/* zerocopy sends in flight */
+};
+
+/*
+ * Make room for len more bytes, doubling the size as often as needed.
+ * Returns -1 if the size would overflow or realloc() fails.
+ */
+static inline int
+buffer_reserve(struct buffer *b, size_t len)
+{
+	size_t size;
+	char *data;
+
+	if (b->size - b->len >= len)
+		return 0;
+	if (len > SIZE_MAX - b->len)
+		return -1;
+
+	for (size = b->size ? b->size : BUFFER_SIZE; size - b->len < len;
+	    size *= 2)
+		if (size > SIZE_MAX / 2) {
+			size = b->len + len;
+			break;
+		}
+	if ((data = realloc(b->data, size)) == NULL)
+		return -1;
+	b->data = data;
+	b->size = size;
+	return 0;
+}
+
+#endif /* __LUABUFFER_H__ */
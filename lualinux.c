@@ -33,6 +33,7 @@
 #include <grp.h>
 #include <lua.h>
 #include <lauxlib.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -135,6 +136,20 @@ linux_setpgid(lua_State *L)
 	return 1;
 }
 
+static int
+linux_sched_setaffinity(lua_State *L)
+{
+	cpu_set_t set;
+	int n;
+
+	CPU_ZERO(&set);
+	for (n = 2; n <= lua_gettop(L); n++)
+		CPU_SET(luaL_checkinteger(L, n), &set);
+	lua_pushboolean(L, sched_setaffinity(luaL_checkinteger(L, 1),
+	    sizeof(set), &set) == 0 ? 1 : 0);
+	return 1;
+}
+
 static int
 linux_sleep(lua_State *L)
 {
@@ -159,6 +174,21 @@ linux_msleep(lua_State *L)
 	return 1;
 }
 
+/* Returns seconds and nanoseconds of a clock, CLOCK_MONOTONIC by default */
+static int
+linux_clock_gettime(lua_State *L)
+{
+	struct timespec ts;
+
+	if (clock_gettime(luaL_optinteger(L, 1, CLOCK_MONOTONIC), &ts)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, ts.tv_sec);
+	lua_pushinteger(L, ts.tv_nsec);
+	return 2;
+}
+
 static int
 linux_unlink(lua_State *L)
 {
@@ -393,6 +423,10 @@ static struct constant linux_constant[] = {
 	CONSTANT(SIGIO),
 	CONSTANT(SIGPWR),
 	CONSTANT(SIGSYS),
+
+	/* clocks */
+	CONSTANT(CLOCK_REALTIME),
+	CONSTANT(CLOCK_MONOTONIC),
 	{ NULL, 0 }
 };
 
@@ -412,8 +446,10 @@ luaopen_linux(lua_State *L)
 		{ "getpass",		linux_getpass },
 		{ "getpid",		linux_getpid },
 		{ "setpgid",		linux_setpgid },
+		{ "sched_setaffinity",	linux_sched_setaffinity },
 		{ "sleep",		linux_sleep },
 		{ "msleep",		linux_msleep },
+		{ "clock_gettime",	linux_clock_gettime },
 		{ "unlink",		linux_unlink },
 		{ "getuid",		linux_getuid },
 		{ "getgid",		linux_getgid },
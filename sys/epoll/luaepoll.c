@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2023 - 2025 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* epoll() for Lua */
+
+#include <sys/epoll.h>
+
+#include <errno.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../lualinux.h"
+#include "../socket/luasocket.h"
+#include "luaepoll.h"
+
+/*
+ * Accept an integer file descriptor, a socket from linux.sys.socket or a
+ * Lua file handle.
+ */
+static int
+epoll_checkfd(lua_State *L, int n)
+{
+	luaL_Stream *stream;
+	int *fd;
+
+	if (lua_isinteger(L, n))
+		return lua_tointeger(L, n);
+	if ((fd = luaL_testudata(L, n, SOCKET_METATABLE)) != NULL)
+		return *fd;
+	if ((stream = luaL_testudata(L, n, LUA_FILEHANDLE)) != NULL
+	    && stream->closef != NULL)
+		return fileno(stream->f);
+	return luaL_argerror(L, n, "socket or file descriptor expected");
+}
+
+static int
+linux_epoll_create(lua_State *L)
+{
+	struct epoll *ep;
+
+	ep = lua_newuserdatauv(L, sizeof(struct epoll), 1);
+	ep->fd = -1;
+	ep->nevents = 0;
+	ep->events = NULL;
+	luaL_getmetatable(L, EPOLL_METATABLE);
+	lua_setmetatable(L, -2);
+
+	/* file descriptor to registered object mapping */
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 1);
+
+	ep->fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ep->fd == -1)
+		lua_pushnil(L);
+	return 1;
+}
+
+static int
+epoll_control(lua_State *L, int op)
+{
+	struct epoll *ep;
+	struct epoll_event ev;
+	int fd;
+
+	ep = luaL_checkudata(L, 1, EPOLL_METATABLE);
+	fd = epoll_checkfd(L, 2);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = luaL_optinteger(L, 3, EPOLLIN);
+	ev.data.fd = fd;
+
+	if (epoll_ctl(ep->fd, op, fd, op == EPOLL_CTL_DEL ? NULL : &ev)) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+
+	/*
+	 * Keep a reference to the registered object, so that wait() can
+	 * return it and it is not collected while it is being watched.
+	 */
+	lua_getiuservalue(L, 1, 1);
+	if (op == EPOLL_CTL_DEL)
+		lua_pushnil(L);
+	else
+		lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, fd);
+	lua_pop(L, 1);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int
+linux_epoll_add(lua_State *L)
+{
+	return epoll_control(L, EPOLL_CTL_ADD);
+}
+
+static int
+linux_epoll_mod(lua_State *L)
+{
+	return epoll_control(L, EPOLL_CTL_MOD);
+}
+
+static int
+linux_epoll_del(lua_State *L)
+{
+	return epoll_control(L, EPOLL_CTL_DEL);
+}
+
+/*
+ * Wait for events and return two arrays: the ready objects (as they were
+ * passed to add()) and the corresponding event masks.
+ */
+static int
+linux_epoll_wait(lua_State *L)
+{
+	struct epoll *ep;
+	struct epoll_event *events;
+	int n, nready, maxevents, timeout;
+
+	ep = luaL_checkudata(L, 1, EPOLL_METATABLE);
+	timeout = luaL_optinteger(L, 2, -1);
+	maxevents = luaL_optinteger(L, 3, EPOLL_MAXEVENTS);
+	luaL_argcheck(L, maxevents > 0, 3, "maxevents must be positive");
+
+	if (maxevents > ep->nevents) {
+		events = realloc(ep->events,
+		    maxevents * sizeof(struct epoll_event));
+		if (events == NULL)
+			return luaL_error(L, "memory error");
+		ep->events = events;
+		ep->nevents = maxevents;
+	}
+
+	nready = epoll_wait(ep->fd, ep->events, maxevents, timeout);
+	if (nready == -1) {
+		if (errno != EINTR) {
+			lua_pushnil(L);
+			return 1;
+		}
+		nready = 0;
+	}
+
+	lua_getiuservalue(L, 1, 1);
+	lua_createtable(L, nready, 0);
+	lua_createtable(L, nready, 0);
+	for (n = 0; n < nready; n++) {
+		if (lua_rawgeti(L, -3, ep->events[n].data.fd) == LUA_TNIL) {
+			lua_pop(L, 1);
+			lua_pushinteger(L, ep->events[n].data.fd);
+		}
+		lua_rawseti(L, -3, n + 1);
+		lua_pushinteger(L, ep->events[n].events);
+		lua_rawseti(L, -2, n + 1);
+	}
+	return 2;
+}
+
+static int
+linux_epoll_fd(lua_State *L)
+{
+	lua_pushinteger(L,
+	    ((struct epoll *)luaL_checkudata(L, 1, EPOLL_METATABLE))->fd);
+	return 1;
+}
+
+static int
+linux_epoll_close(lua_State *L)
+{
+	struct epoll *ep;
+
+	ep = luaL_checkudata(L, 1, EPOLL_METATABLE);
+	if (ep->fd >= 0) {
+		close(ep->fd);
+		ep->fd = -1;
+	}
+	free(ep->events);
+	ep->events = NULL;
+	ep->nevents = 0;
+	return 0;
+}
+
+static struct constant epoll_constant[] = {
+	CONSTANT(EPOLLIN),
+	CONSTANT(EPOLLOUT),
+	CONSTANT(EPOLLRDHUP),
+	CONSTANT(EPOLLPRI),
+	CONSTANT(EPOLLERR),
+	CONSTANT(EPOLLHUP),
+	CONSTANT(EPOLLET),
+	CONSTANT(EPOLLONESHOT),
+	CONSTANT(EPOLLEXCLUSIVE),
+	CONSTANT(EPOLLWAKEUP),
+	{ NULL, 0 }
+};
+
+int
+luaopen_linux_sys_epoll(lua_State *L)
+{
+	struct luaL_Reg lualinuxepoll[] = {
+		{ "create",	linux_epoll_create },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg epoll_methods[] = {
+		{ "add",	linux_epoll_add },
+		{ "mod",	linux_epoll_mod },
+		{ "del",	linux_epoll_del },
+		{ "wait",	linux_epoll_wait },
+		{ "fd",		linux_epoll_fd },
+		{ "close",	linux_epoll_close },
+		{ NULL,		NULL }
+	};
+	int n;
+
+	if (luaL_newmetatable(L, EPOLL_METATABLE)) {
+		luaL_setfuncs(L, epoll_methods, 0);
+
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, linux_epoll_close);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__close");
+		lua_pushcfunction(L, linux_epoll_close);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	luaL_newlib(L, lualinuxepoll);
+	for (n = 0; epoll_constant[n].name != NULL; n++) {
+		lua_pushinteger(L, epoll_constant[n].value);
+		lua_setfield(L, -2, epoll_constant[n].name);
+	}
+	return 1;
+}
@@ -0,0 +1,208 @@
+-- Loopback benchmark for linux.sys.socket
+--
+-- Usage: lua bench.lua [operations]
+--
+-- A forked echo server is driven over TCP loopback and AF_UNIX for
+-- several message sizes and connection counts.  Each result is written
+-- as one JSON object per line, so runs can be compared with diff or jq.
+-- Latencies are in microseconds; syscalls_per_op counts the system calls
+-- made by the client sockets.
+
+local linux = require 'linux'
+local socket = require 'linux.sys.socket'
+
+local OPS = tonumber(arg and arg[1]) or 2000
+local SIZES = { 16, 256, 4096, 65536 }
+local CONNS = { 1, 16 }
+local TCPPORT = tostring(24000 + linux.getpid() % 1000)
+local UNIXPATH = '/tmp/luasocket-bench.' .. linux.getpid()
+
+local function now()
+	local sec, nsec = linux.clock_gettime(linux.CLOCK_MONOTONIC)
+	return sec * 1000000 + nsec // 1000
+end
+
+local function json(t, keys)
+	local out = {}
+
+	for _, k in ipairs(keys) do
+		local v = t[k]
+		if type(v) == 'string' then
+			v = string.format('%q', v)
+		elseif v == nil then
+			v = 'null'
+		elseif math.type(v) == 'float' then
+			v = string.format('%.2f', v)
+		end
+		out[#out + 1] = string.format('"%s":%s', k, v)
+	end
+	return '{' .. table.concat(out, ',') .. '}'
+end
+
+local KEYS = { 'test', 'transport', 'size', 'conns', 'ops', 'seconds',
+    'ops_per_sec', 'mb_per_sec', 'p50_us', 'p99_us', 'syscalls_per_op' }
+
+-- Echo everything received on every accepted connection
+local function server(listeners)
+	local sched = socket.scheduler()
+
+	for _, l in ipairs(listeners) do
+		l:setnonblock()
+		sched:spawn(function ()
+			while true do
+				local c = l:accept()
+				if c then
+					c:setnonblock()
+					c:setopt('nodelay', true)
+					sched:spawn(function ()
+						while true do
+							local data = c:read(65536)
+							if not data then
+								break
+							end
+							c:write(data)
+						end
+						c:close()
+					end)
+				end
+			end
+		end)
+	end
+	sched:run()
+	os.exit(0)
+end
+
+local function connect(transport)
+	local c
+
+	if transport == 'tcp' then
+		c = socket.connect('127.0.0.1', TCPPORT, { nodelay = true })
+	else
+		c = socket.connect(UNIXPATH)
+	end
+	c:setnonblock()
+	return c
+end
+
+-- Read exactly len bytes
+local function readn(c, len)
+	local got = 0
+
+	while got < len do
+		local data = c:read(len - got)
+		if not data then
+			error('connection closed by the server')
+		end
+		got = got + #data
+	end
+end
+
+local tests = {}
+
+tests['write/read'] = function (c, payload)
+	c:write(payload)
+	readn(c, #payload)
+end
+
+tests['print/readln'] = function (c, payload)
+	c:print(payload:sub(2))
+	c:readln()
+end
+
+tests['write_frame/read_frame'] = function (c, payload)
+	c:write_frame(payload)
+	c:read_frame()
+end
+
+-- Run ops operations spread over conns coroutines
+local function run(name, transport, size, conns)
+	local payload = string.rep('x', size)
+	local latencies = {}
+	local syscalls = 0
+	local sched = socket.scheduler()
+	local perconn = OPS // conns
+	local op = tests[name]
+	local start
+
+	for n = 1, conns do
+		sched:spawn(function ()
+			if name == 'accept' then
+				for i = 1, perconn do
+					local t0 = now()
+					local c = connect(transport)
+					c:close()
+					latencies[#latencies + 1] = now() - t0
+				end
+				return
+			end
+
+			local c = connect(transport)
+			c:setstats()
+			for i = 1, perconn do
+				local t0 = now()
+				op(c, payload)
+				latencies[#latencies + 1] = now() - t0
+			end
+			local st = c:stats()
+			syscalls = syscalls + st.reads + st.writes
+			c:close()
+		end)
+	end
+
+	start = now()
+	sched:run()
+	local elapsed = (now() - start) / 1000000
+
+	table.sort(latencies)
+	local ops = #latencies
+	return {
+		test = name,
+		transport = transport,
+		size = name ~= 'accept' and size or nil,
+		conns = conns,
+		ops = ops,
+		seconds = elapsed,
+		ops_per_sec = ops / elapsed,
+		mb_per_sec = name ~= 'accept' and
+		    ops * size / elapsed / (1024 * 1024) or nil,
+		p50_us = latencies[math.max(1, math.ceil(ops * 0.50))],
+		p99_us = latencies[math.max(1, math.ceil(ops * 0.99))],
+		syscalls_per_op = name ~= 'accept' and syscalls / ops or nil
+	}
+end
+
+os.remove(UNIXPATH)
+local listeners = {
+	socket.bind('127.0.0.1', TCPPORT, 128, { reuseaddr = true }),
+	socket.bind(UNIXPATH, 128)
+}
+
+local pid = linux.fork()
+if pid == 0 then
+	server(listeners)
+end
+for _, l in ipairs(listeners) do
+	l:close()
+end
+
+local ok, err = pcall(function ()
+	for _, transport in ipairs({ 'tcp', 'unix' }) do
+		for _, conns in ipairs(CONNS) do
+			for _, name in ipairs({ 'write/read', 'print/readln',
+			    'write_frame/read_frame' }) do
+				for _, size in ipairs(SIZES) do
+					print(json(run(name, transport, size,
+					    conns), KEYS))
+				end
+			end
+			print(json(run('accept', transport, 0, conns), KEYS))
+		end
+	end
+end)
+
+linux.kill(pid, linux.SIGTERM)
+os.remove(UNIXPATH)
+if not ok then
+	io.stderr:write('bench: ', err, '\n')
+	os.exit(1)
+end
@@ -23,92 +23,575 @@
 
 /* network access extension module  */
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
 
+#include <ctype.h>
 #include <errno.h>
 #ifdef LIBFETCH
 #include <fetch.h>
 #endif
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
+#include "../../buffer/luabuffer.h"
 #include "luasocket.h"
 
-static ssize_t
-to_read(int fd, void *buf, size_t len, int ms)
+static struct socket *
+luanet_pushsocket(lua_State *L, int fd)
+{
+	struct socket *s;
+
+	s = lua_newuserdata(L, sizeof(struct socket));
+	s->fd = fd;
+	s->nonblock = 0;
+	s->wdone = 0;
+	s->rbuf = NULL;
+	s->rsize = s->rpos = s->rend = 0;
+	s->framing = NET_FRAMING;
+	s->stats = NULL;
+	s->zerocopy = 0;
+	s->zcnext = 0;
+	s->zcpending = 0;
+	s->deadline = 0;
+	s->rcvtimeo = s->sndtimeo = 0;
+	luaL_getmetatable(L, SOCKET_METATABLE);
+	lua_setmetatable(L, -2);
+	return s;
+}
+
+/* First value yielded by coroutines that wait for the scheduler */
+static int sched_marker;
+
+/*
+ * Return true if L is a coroutine run by the current scheduler, i.e. if
+ * an operation that would block may yield instead.
+ */
+static int
+sched_active(lua_State *L)
+{
+	int active;
+
+	if (!lua_isyieldable(L))
+		return 0;
+	if (lua_getfield(L, LUA_REGISTRYINDEX, SCHED_CURRENT)
+	    != LUA_TUSERDATA) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	lua_getiuservalue(L, -1, 2);
+	lua_pushthread(L);
+	active = lua_rawget(L, -2) != LUA_TNIL;
+	lua_pop(L, 3);
+	return active;
+}
+
+/*
+ * The scheduler resumes a waiting coroutine with a boolean that is true
+ * if the wait timed out.  Otherwise the operation is retried, it finds
+ * its arguments on the stack as they were when it yielded.
+ */
+static int
+sched_continue(lua_State *L, int status, lua_KContext ctx)
+{
+	struct socket *s;
+	int timedout;
+
+	timedout = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	if (timedout) {
+		/* a timed out write is abandoned */
+		if ((s = luaL_testudata(L, 1, SOCKET_METATABLE)) != NULL)
+			s->wdone = 0;
+		lua_pushnil(L);
+		return 1;
+	}
+	return ((lua_CFunction)ctx)(L);
+}
+
+/*
+ * Yield to the scheduler until fd becomes ready for events or ms
+ * milliseconds have passed, then call retry.  Must only be called with
+ * nothing but the arguments of the operation on the stack.
+ */
+static int
+sched_block(lua_State *L, int fd, short events, int ms, lua_CFunction retry)
+{
+	lua_pushlightuserdata(L, &sched_marker);
+	lua_pushinteger(L, fd);
+	lua_pushinteger(L, events);
+	lua_pushinteger(L, ms);
+	return lua_yieldk(L, 4, (lua_KContext)retry, sched_continue);
+}
+
+/* Milliseconds on the monotonic clock */
+static long long
+sock_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Wait until the socket becomes readable or writable */
+static int
+sock_wait(int fd, short events, int ms)
 {
 	struct pollfd p;
 	int r;
 
 	p.fd = fd;
-	p.events = POLLIN;
+	p.events = events;
 	p.revents = 0;
 
-	if ((r = poll(&p, 1, ms)) > 0)
-		r = read(fd, buf, len);
+	do
+		r = poll(&p, 1, ms);
+	while (r == -1 && errno == EINTR);
 	return r;
 }
 
-/* XXX factor out common code */
+/* Count a system call that transferred n bytes or failed with n == -1 */
+static void
+sock_account(struct socket *s, int out, ssize_t n)
+{
+	struct sockstats *st = s->stats;
+
+	if (st == NULL)
+		return;
+	if (out) {
+		st->writes++;
+		if (n > 0)
+			st->wbytes += n;
+	} else {
+		st->reads++;
+		if (n > 0)
+			st->rbytes += n;
+	}
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		st->eagain++;
+}
+
+/* Cap a timeout in milliseconds at the time left until the deadline */
 static int
-asreadln(int fd, char **ret, int ms)
+sock_timeout(struct socket *s, int ms)
 {
-	struct pollfd p;
-	int r, n;
-	size_t len, nread;
-	char *s;
+	long long left;
 
-	p.fd = fd;
-	p.events = POLLIN;
-	p.revents = 0;
+	if (s->deadline == 0)
+		return ms;
+	left = s->deadline - sock_now();
+	if (left < 0)
+		left = 0;
+	return ms < 0 || ms > left ? (int)left : ms;
+}
+
+/* Return true once the deadline has passed */
+static int
+sock_expired(struct socket *s)
+{
+	return s->deadline != 0 && sock_now() >= s->deadline;
+}
+
+/*
+ * Enforce the deadline before a read (out == 0) or a write, failing with
+ * ETIMEDOUT once it has passed, even if data is ready.  A blocking socket
+ * gets the time left as SO_RCVTIMEO or SO_SNDTIMEO, so the kernel ends a
+ * call that would outlast the deadline and no poll() is needed before
+ * each call.  The kernel timeout is renewed only after it has become
+ * NET_DEADLINESLACK milliseconds too long.
+ */
+static int
+sock_deadline(struct socket *s, int out)
+{
+	struct timeval tv;
+	long long left;
+	int *timeo;
 
-	*ret = malloc(NET_BUFSIZ);
-	if (*ret == NULL)
+	if (s->deadline == 0)
+		return 0;
+	left = s->deadline - sock_now();
+	if (left <= 0) {
+		errno = ETIMEDOUT;
 		return -1;
-	len = NET_BUFSIZ;
-	nread = 0;
-	s = *ret;
-	do {
-		n = 0;
-		r = poll(&p, 1, ms);
-		switch (r) {
-		case 0:
-			fprintf(stderr, "poll timeout\n");
+	}
+	if (s->nonblock)
+		return 0;
+
+	timeo = out ? &s->sndtimeo : &s->rcvtimeo;
+	if (*timeo == 0 || *timeo > left + NET_DEADLINESLACK) {
+		tv.tv_sec = left / 1000;
+		tv.tv_usec = (left % 1000) * 1000;
+		if (setsockopt(s->fd, SOL_SOCKET, out ? SO_SNDTIMEO :
+		    SO_RCVTIMEO, &tv, sizeof(tv)))
+			return -1;
+		*timeo = left;
+	}
+	return 0;
+}
+
+/* Remove the deadline and the kernel timeouts it has set */
+static void
+sock_nodeadline(struct socket *s)
+{
+	struct timeval tv;
+
+	tv.tv_sec = tv.tv_usec = 0;
+	if (s->rcvtimeo)
+		setsockopt(s->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (s->sndtimeo)
+		setsockopt(s->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	s->deadline = 0;
+	s->rcvtimeo = s->sndtimeo = 0;
+}
+
+/*
+ * sock_wait() for a socket, timed if the socket keeps statistics.  The
+ * wait ends at the deadline of the socket at the latest.
+ */
+static int
+sock_poll(struct socket *s, short events, int ms)
+{
+	struct timespec t0, t1;
+	int n;
+
+	ms = sock_timeout(s, ms);
+	if (s->stats == NULL)
+		return sock_wait(s->fd, events, ms);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	n = sock_wait(s->fd, events, ms);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	s->stats->polls++;
+	s->stats->polltime += (t1.tv_sec - t0.tv_sec) * 1000000LL +
+	    (t1.tv_nsec - t0.tv_nsec) / 1000;
+	return n;
+}
+
+/* Advance over n bytes of a message, returns the number of bytes skipped */
+static size_t
+iov_advance(struct msghdr *msg, size_t n)
+{
+	size_t done;
+
+	for (done = 0; msg->msg_iovlen > 0 && n >= msg->msg_iov->iov_len;
+	    msg->msg_iov++, msg->msg_iovlen--) {
+		n -= msg->msg_iov->iov_len;
+		done += msg->msg_iov->iov_len;
+	}
+	if (msg->msg_iovlen > 0 && n > 0) {
+		msg->msg_iov->iov_base = (char *)msg->msg_iov->iov_base + n;
+		msg->msg_iov->iov_len -= n;
+		done += n;
+	}
+	return done;
+}
+
+/*
+ * Send all data described by iov, advancing over partial writes.  The
+ * first *skip bytes have been sent before the operation yielded and are
+ * skipped, bytes sent are accounted in s->wdone.  The iovec array is
+ * modified.  Returns the number of bytes sent, -1 on error or
+ * SOCK_WOULDBLOCK if the calling coroutine must wait.
+ */
+static ssize_t
+sock_writev(lua_State *L, struct socket *s, struct iovec *iov, int iovcnt,
+    int flags, size_t *skip)
+{
+	struct msghdr msg;
+	size_t total;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	*skip -= iov_advance(&msg, *skip);
+
+	total = 0;
+	while (msg.msg_iovlen > 0) {
+		if (sock_deadline(s, 1))
+			return -1;
+		n = sendmsg(s->fd, &msg, flags);
+		sock_account(s, 1, n);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				if (sched_active(L))
+					return SOCK_WOULDBLOCK;
+				if (sock_poll(s, POLLOUT, -1) > 0)
+					continue;
+			}
+			return -1;
+		}
+		total += n;
+		s->wdone += n;
+		iov_advance(&msg, n);
+	}
+	return total;
+}
+
+/* Push a peer address as a table with host and port or with a path */
+static void
+luanet_pushaddr(lua_State *L, struct sockaddr *sa, socklen_t len)
+{
+	struct sockaddr_un *sun;
+	char host[INET6_ADDRSTRLEN];
+
+	lua_createtable(L, 0, 2);
+	switch (sa->sa_family) {
+	case AF_INET:
+		inet_ntop(AF_INET, &((struct sockaddr_in *)sa)->sin_addr,
+		    host, sizeof(host));
+		lua_pushstring(L, host);
+		lua_setfield(L, -2, "host");
+		lua_pushinteger(L, ntohs(((struct sockaddr_in *)sa)->sin_port));
+		lua_setfield(L, -2, "port");
+		break;
+	case AF_INET6:
+		inet_ntop(AF_INET6, &((struct sockaddr_in6 *)sa)->sin6_addr,
+		    host, sizeof(host));
+		lua_pushstring(L, host);
+		lua_setfield(L, -2, "host");
+		lua_pushinteger(L,
+		    ntohs(((struct sockaddr_in6 *)sa)->sin6_port));
+		lua_setfield(L, -2, "port");
+		break;
+	case AF_UNIX:
+		sun = (struct sockaddr_un *)sa;
+		if (len <= offsetof(struct sockaddr_un, sun_path))
 			break;
-		case -1:
-			fprintf(stderr, "poll error\n");
+		len -= offsetof(struct sockaddr_un, sun_path);
+		if (sun->sun_path[0] == '\0') {
+			/* abstract namespace */
+			lua_pushliteral(L, "@");
+			lua_pushlstring(L, sun->sun_path + 1, len - 1);
+			lua_concat(L, 2);
+			lua_setfield(L, -2, "path");
+		} else {
+			lua_pushlstring(L, sun->sun_path,
+			    strnlen(sun->sun_path, len));
+			lua_setfield(L, -2, "path");
+		}
+		break;
+	}
+}
+
+/*
+ * Convert a numeric host address and port to a socket address of the
+ * given family.  IPv4 addresses are mapped when the family is AF_INET6.
+ */
+static int
+sock_parseaddr(int family, const char *host, int port,
+    struct sockaddr_storage *ss, socklen_t *len)
+{
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+	char mapped[INET6_ADDRSTRLEN + 7];
+
+	memset(ss, 0, sizeof(struct sockaddr_storage));
+	if (family == AF_INET) {
+		sin = (struct sockaddr_in *)ss;
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		*len = sizeof(struct sockaddr_in);
+		return inet_pton(AF_INET, host, &sin->sin_addr) == 1 ? 0 : -1;
+	} else if (family == AF_INET6) {
+		sin6 = (struct sockaddr_in6 *)ss;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		*len = sizeof(struct sockaddr_in6);
+		if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1)
+			return 0;
+		snprintf(mapped, sizeof(mapped), "::ffff:%s", host);
+		return inet_pton(AF_INET6, mapped, &sin6->sin6_addr) == 1 ?
+		    0 : -1;
+	}
+	return -1;
+}
+
+/* Socket types that can be selected for AF_UNIX sockets */
+static const char *const unix_typenames[] = {
+	"stream", "seqpacket", "dgram", NULL
+};
+static const int unix_types[] = {
+	SOCK_STREAM, SOCK_SEQPACKET, SOCK_DGRAM
+};
+
+/* Host names starting with '/', '.' or '@' denote AF_UNIX sockets */
+static int
+sock_isunix(const char *host)
+{
+	return *host == '/' || *host == '.' || *host == '@';
+}
+
+/*
+ * Fill in an AF_UNIX address.  A leading '@' selects the abstract
+ * namespace: the name is not NUL terminated and does not appear in the
+ * file system, so there is no socket file to remove.
+ */
+static int
+sock_unixaddr(const char *path, struct sockaddr_un *sun, socklen_t *len)
+{
+	size_t n;
+
+	n = strlen(path);
+	if (n >= sizeof(sun->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(sun, 0, sizeof(struct sockaddr_un));
+	sun->sun_family = AF_UNIX;
+	memcpy(sun->sun_path, path, n);
+	if (*path == '@') {
+		sun->sun_path[0] = '\0';
+		*len = offsetof(struct sockaddr_un, sun_path) + n;
+	} else
+		*len = sizeof(struct sockaddr_un);
+	return 0;
+}
+
+/* The type option overrides the socket type of AF_UNIX sockets */
+static int
+sock_unixtype(lua_State *L, int opts, int type)
+{
+	if (opts == 0)
+		return type;
+	if (lua_getfield(L, opts, "type") != LUA_TNIL)
+		type = unix_types[luaL_checkoption(L, -1, NULL,
+		    unix_typenames)];
+	lua_pop(L, 1);
+	return type;
+}
+
+/*
+ * Read as much as fits into the socket buffer, making room first by
+ * moving unconsumed data to the front or by growing the buffer.  Returns
+ * the number of bytes read, 0 on end of file, -1 on timeout or error and
+ * SOCK_WOULDBLOCK if the calling coroutine must wait for the scheduler.
+ */
+static ssize_t
+sock_fill(lua_State *L, struct socket *s, int ms)
+{
+	ssize_t n;
+	char *buf;
+
+	if (s->rbuf == NULL) {
+		if ((s->rbuf = malloc(NET_BUFSIZ)) == NULL)
+			return -1;
+		s->rsize = NET_BUFSIZ;
+	}
+
+	if (s->rpos == s->rend)
+		s->rpos = s->rend = 0;
+	else if (s->rend == s->rsize) {
+		if (s->rpos > 0) {
+			memmove(s->rbuf, s->rbuf + s->rpos, s->rend - s->rpos);
+			s->rend -= s->rpos;
+			s->rpos = 0;
+		} else {
+			if ((buf = realloc(s->rbuf, s->rsize * 2)) == NULL)
+				return -1;
+			s->rbuf = buf;
+			s->rsize *= 2;
+		}
+	}
+
+	if (sock_deadline(s, 0))
+		return -1;
+
+	/* a blocking read can not time out */
+	if (ms >= 0 && !s->nonblock && sock_poll(s, POLLIN, ms) <= 0)
+		return -1;
+
+	for (;;) {
+		n = read(s->fd, s->rbuf + s->rend, s->rsize - s->rend);
+		sock_account(s, 0, n);
+		if (n >= 0 || (errno != EINTR && errno != EAGAIN))
 			break;
-		default:
-			if (len - nread > 0) {
-				/* read one character at a time */
-				n = read(fd, s, 1);
-				nread += n;
-				s += n;
-			} else {
-				len *= 2;
-				*ret = realloc(*ret, len);
-				if (*ret == NULL)
-					fprintf(stderr, "memory error\n");
-				s = *ret + nread;
-				n = 1;
+		if (errno == EAGAIN) {
+			if (sched_active(L))
+				return SOCK_WOULDBLOCK;
+			if (sock_poll(s, POLLIN, ms) <= 0)
+				break;
+		}
+	}
+	if (n > 0)
+		s->rend += n;
+	return n;
+}
+
+/*
+ * Push everything up to the delimiter and consume it including the
+ * delimiter.  Data that is still buffered at end of file is returned
+ * as is, on timeout or error nil is returned and the data stays buffered.
+ * A coroutine that has to wait calls retry when it is resumed.
+ */
+static int
+sock_pushuntil(lua_State *L, struct socket *s, const char *delim,
+    size_t dlen, int ms, lua_CFunction retry)
+{
+	size_t avail, searched;
+	char *p;
+
+	searched = 0;
+	for (;;) {
+		avail = s->rend - s->rpos;
+		p = avail > searched ? memmem(s->rbuf + s->rpos + searched,
+		    avail - searched, delim, dlen) : NULL;
+		if (p != NULL) {
+			lua_pushlstring(L, s->rbuf + s->rpos,
+			    p - (s->rbuf + s->rpos));
+			s->rpos = p - s->rbuf + dlen;
+			return 1;
+		}
+
+		/* the delimiter could straddle the end of the buffer */
+		searched = avail >= dlen ? avail - dlen + 1 : 0;
+
+		switch (sock_fill(L, s, ms)) {
+		case SOCK_WOULDBLOCK:
+			return sched_block(L, s->fd, POLLIN, sock_timeout(s, ms),
+			    retry);
+		case 0:
+			if (avail > 0) {
+				lua_pushlstring(L, s->rbuf + s->rpos, avail);
+				s->rpos = s->rend;
+				return 1;
 			}
+			/* FALLTHROUGH */
+		case -1:
+			lua_pushnil(L);
+			return 1;
 		}
-	} while (n > 0 && (*ret)[nread - 1] != '\n');
-	(*ret)[nread - 1] = '\0';
-	return nread;
+	}
 }
 
 static int
@@ -116,362 +599,4028 @@ luanet_accept(lua_State *L)
 {
 	struct sockaddr_storage addr;
 	socklen_t len = sizeof(addr);
-	int s, *data;
+	int fd, s;
 
-	s = accept(*(int *)luaL_checkudata(L, 1, SOCKET_METATABLE),
-	    (struct sockaddr *)&addr, &len);
+	fd = *(int *)luaL_checkudata(L, 1, SOCKET_METATABLE);
+	s = accept(fd, (struct sockaddr *)&addr, &len);
 	if (s == -1) {
+		if (errno == EAGAIN && sched_active(L))
+			return sched_block(L, fd, POLLIN, -1, luanet_accept);
 		lua_pushnil(L);
 		return 1;
 	}
-	data = (int *)lua_newuserdata(L, sizeof(int *));
-	*data = s;
-	luaL_getmetatable(L, SOCKET_METATABLE);
-	lua_setmetatable(L, -2);
+	luanet_pushsocket(L, s);
 	return 1;
 }
 
+/*
+ * Accept up to n pending connections, stopping when none is left.  The
+ * new sockets are non-blocking and close-on-exec.  Returns an array of
+ * sockets and an array of peer addresses.  On a blocking listener, only
+ * the first accept() may block.
+ */
 static int
-luanet_bind(lua_State *L)
+luanet_accept_many(lua_State *L)
 {
-	struct addrinfo hints, *res, *res0;
-	struct sockaddr_un addr;
-	int fd, error, *data;
-	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-	const char *port, *host;
+	struct sockaddr_storage addr;
+	socklen_t len;
+	int fd, s, n, max, nonblock;
 
-	host = luaL_checkstring(L, 1);
+	fd = *(int *)luaL_checkudata(L, 1, SOCKET_METATABLE);
+	max = luaL_optinteger(L, 2, NET_MAXMSGS);
+	nonblock = fcntl(fd, F_GETFL) & O_NONBLOCK;
 
-	if (*host == '/' || *host == '.') {
-		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	lua_newtable(L);
+	lua_newtable(L);
+	for (n = 0; n < max; ) {
+		if (n > 0 && !nonblock && sock_wait(fd, POLLIN, 0) <= 0)
+			break;
+		len = sizeof(addr);
+		s = accept4(fd, (struct sockaddr *)&addr, &len,
+		    SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (s == -1) {
+			if (errno == EINTR)
+				continue;
+			if (n == 0 && errno == EAGAIN && sched_active(L)) {
+				lua_pop(L, 2);
+				return sched_block(L, fd, POLLIN, -1,
+				    luanet_accept_many);
+			}
+			break;
+		}
+		n++;
+		luanet_pushsocket(L, s)->nonblock = 1;
+		lua_rawseti(L, -3, n);
+		luanet_pushaddr(L, (struct sockaddr *)&addr, len);
+		lua_rawseti(L, -2, n);
+	}
+	return 2;
+}
 
-		if (fd < 0)
-			return luaL_error(L, "connection error");
+/* Named socket options for setopt(), getopt() and bind/connect tables */
+static const struct sockopt {
+	const char	*name;
+	int		 level;
+	int		 optname;
+	int		 boolean;
+} sockopts[] = {
+	{ "reuseaddr",		SOL_SOCKET,	SO_REUSEADDR,		1 },
+	{ "reuseport",		SOL_SOCKET,	SO_REUSEPORT,		1 },
+	{ "keepalive",		SOL_SOCKET,	SO_KEEPALIVE,		1 },
+	{ "broadcast",		SOL_SOCKET,	SO_BROADCAST,		1 },
+	{ "sndbuf",		SOL_SOCKET,	SO_SNDBUF,		0 },
+	{ "rcvbuf",		SOL_SOCKET,	SO_RCVBUF,		0 },
+	{ "rcvlowat",		SOL_SOCKET,	SO_RCVLOWAT,		0 },
+	{ "priority",		SOL_SOCKET,	SO_PRIORITY,		0 },
+	{ "mark",		SOL_SOCKET,	SO_MARK,		0 },
+	{ "busy_poll",		SOL_SOCKET,	SO_BUSY_POLL,		0 },
+	{ "incoming_cpu",	SOL_SOCKET,	SO_INCOMING_CPU,	0 },
+	{ "nodelay",		IPPROTO_TCP,	TCP_NODELAY,		1 },
+	{ "cork",		IPPROTO_TCP,	TCP_CORK,		1 },
+	{ "quickack",		IPPROTO_TCP,	TCP_QUICKACK,		1 },
+	{ "keepidle",		IPPROTO_TCP,	TCP_KEEPIDLE,		0 },
+	{ "keepintvl",		IPPROTO_TCP,	TCP_KEEPINTVL,		0 },
+	{ "keepcnt",		IPPROTO_TCP,	TCP_KEEPCNT,		0 },
+	{ "fastopen",		IPPROTO_TCP,	TCP_FASTOPEN,		0 },
+	{ "fastopen_connect",	IPPROTO_TCP,	TCP_FASTOPEN_CONNECT,	1 },
+	{ "defer_accept",	IPPROTO_TCP,	TCP_DEFER_ACCEPT,	0 },
+	{ "user_timeout",	IPPROTO_TCP,	TCP_USER_TIMEOUT,	0 },
+	{ "notsent_lowat",	IPPROTO_TCP,	TCP_NOTSENT_LOWAT,	0 },
+	{ "maxseg",		IPPROTO_TCP,	TCP_MAXSEG,		0 },
+	{ NULL,			0,		0,			0 }
+};
 
-		memset(&addr, 0, sizeof(struct sockaddr_un));
-		addr.sun_family = AF_UNIX;
-		strncpy(addr.sun_path, host, sizeof(addr.sun_path) - 1);
+static const struct sockopt *
+sock_findopt(lua_State *L, int arg)
+{
+	const struct sockopt *o;
+	const char *name;
 
-		if (bind(fd, (struct sockaddr *)&addr,
-		    sizeof(struct sockaddr_un)) == -1) {
-		    	close(fd);
-			return luaL_error(L, "bind error");
-		}
+	name = luaL_checkstring(L, arg);
+	for (o = sockopts; o->name != NULL; o++)
+		if (!strcmp(o->name, name))
+			return o;
+	luaL_argerror(L, arg, lua_pushfstring(L, "unknown option '%s'", name));
+	return NULL;
+}
 
-		if (listen(fd, lua_gettop(L) > 1 ? luaL_checkinteger(L, 2) : 32))
-			return luaL_error(L, "listen error");
+/*
+ * Apply the named options found in the table at index opts to a socket
+ * that has neither been bound nor connected yet.  Other fields of the
+ * table are ignored.
+ */
+static int
+sock_setopts(lua_State *L, int opts, int fd)
+{
+	const struct sockopt *o;
+	int val, error = 0;
 
-	} else {
-		port = luaL_checkstring(L, 2);
+	if (opts == 0)
+		return 0;
 
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_socktype = SOCK_STREAM;
-		error = getaddrinfo(host, port, &hints, &res0);
-		if (error) {
-			fprintf(stderr, "%s: %s\n", host, gai_strerror(error));
-			return -1;
+	for (o = sockopts; o->name != NULL && !error; o++) {
+		switch (lua_getfield(L, opts, o->name)) {
+		case LUA_TNIL:
+			lua_pop(L, 1);
+			continue;
+		case LUA_TBOOLEAN:
+			val = lua_toboolean(L, -1);
+			break;
+		default:
+			val = lua_tointeger(L, -1);
 		}
-		fd = -1;
-		for (res = res0; res; res = res->ai_next) {
-			error = getnameinfo(res->ai_addr, res->ai_addrlen, hbuf,
-			    sizeof(hbuf), sbuf, sizeof(sbuf), NI_NUMERICHOST |
-			    NI_NUMERICSERV);
-			if (error)
-				continue;
-			fd = socket(res->ai_family, res->ai_socktype,
-			    res->ai_protocol);
-			if (fd < 0)
-				continue;
-			if (bind(fd, res->ai_addr, res->ai_addrlen) < 0) {
-				close(fd);
-				fd = -1;
-				continue;
+		lua_pop(L, 1);
+		error = setsockopt(fd, o->level, o->optname, &val, sizeof(val));
+	}
+	return error;
+}
+
+/*
+ * Steer new connections in a SO_REUSEPORT group to the listener whose
+ * index in the group equals the CPU that received the packet, modulo the
+ * group size.  Listeners join the group in the order they are bound, so
+ * the master should bind all listeners before forking the workers and
+ * pin worker n, which keeps listener n, to CPU n.
+ */
+static int
+sock_cpusteer(int fd, int nlisteners)
+{
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, nlisteners },
+		{ BPF_RET | BPF_A, 0, 0, 0 }
+	};
+	struct sock_fprog prog;
+
+	if (nlisteners <= 0)
+		return -1;
+
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+	    sizeof(prog));
+}
+
+/*
+ * Resolver
+ *
+ * Results of getaddrinfo() are copied into a userdata that holds the
+ * addrinfo list together with the addresses it points to.  Entries are
+ * cached in a registry table for dnsttl milliseconds.  Coroutines running
+ * on a scheduler resolve names that are not cached with getaddrinfo_a()
+ * and yield until an eventfd signals the completion.
+ */
+
+/* Cached getaddrinfo() result, followed by the addresses it points to */
+struct dnsentry {
+	long long	 expires;
+	int		 naddrs;
+	struct addrinfo	 ai[];
+};
+
+/* getaddrinfo_a() request, owned by the userdata and the resolver */
+struct dnsquery {
+	struct gaicb	 cb;
+	struct addrinfo	 hints;
+	int		 efd;		/* eventfd signalled on completion */
+	int		 refs;
+	char		 name[];	/* host and service */
+};
+
+static int dnsttl = NET_DNSTTL;
+static unsigned int dnsstores;
+
+/* Copy an addrinfo list into a new entry on top of the stack */
+static struct dnsentry *
+dns_newentry(lua_State *L, struct addrinfo *res0)
+{
+	struct dnsentry *e;
+	struct sockaddr_storage *ss;
+	struct addrinfo *res;
+	int n;
+
+	for (n = 0, res = res0; res; res = res->ai_next)
+		n++;
+
+	e = lua_newuserdatauv(L, sizeof(struct dnsentry) + n *
+	    (sizeof(struct addrinfo) + sizeof(struct sockaddr_storage)), 0);
+	e->expires = sock_now() + dnsttl;
+	e->naddrs = n;
+
+	ss = (struct sockaddr_storage *)&e->ai[n];
+	for (n = 0, res = res0; res; res = res->ai_next, n++) {
+		e->ai[n] = *res;
+		memcpy(&ss[n], res->ai_addr, res->ai_addrlen);
+		e->ai[n].ai_addr = (struct sockaddr *)&ss[n];
+		e->ai[n].ai_canonname = NULL;
+		e->ai[n].ai_next = res->ai_next ? &e->ai[n + 1] : NULL;
+	}
+	return e;
+}
+
+static void
+dns_pushkey(lua_State *L, const char *host, const char *port, int type)
+{
+	lua_pushfstring(L, "%s %s %d", host, port, type);
+}
+
+/* Cache the entry on top of the stack under the key at index key */
+static void
+dns_store(lua_State *L, int key)
+{
+	struct dnsentry *e;
+	long long now;
+
+	if (dnsttl <= 0)
+		return;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, DNS_CACHE);
+	if (++dnsstores % NET_DNSSWEEP == 0) {
+		now = sock_now();
+		lua_pushnil(L);
+		while (lua_next(L, -2)) {
+			e = lua_touserdata(L, -1);
+			lua_pop(L, 1);
+			if (e->expires <= now) {
+				/* clearing fields during traversal is allowed */
+				lua_pushvalue(L, -1);
+				lua_pushnil(L);
+				lua_rawset(L, -4);
 			}
-			break;
 		}
+	}
+	lua_pushvalue(L, key);
+	lua_pushvalue(L, -3);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+static void
+dns_release(struct dnsquery *q)
+{
+	if (__atomic_sub_fetch(&q->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		if (q->cb.ar_result != NULL)
+			freeaddrinfo(q->cb.ar_result);
+		close(q->efd);
+		free(q);
+	}
+}
+
+/* Runs on a resolver thread once a query has completed */
+static void
+dns_notify(union sigval sv)
+{
+	struct dnsquery *q = sv.sival_ptr;
+	uint64_t one = 1;
+
+	if (write(q->efd, &one, sizeof(one)) == -1)
+		syslog(LOG_ERR, "dns_notify: %m");
+	dns_release(q);
+}
+
+/* Start an asynchronous lookup, the query is pushed on the stack */
+static struct dnsquery *
+dns_query(lua_State *L, const char *host, const char *port, int type)
+{
+	struct dnsquery **qp, *q;
+	struct gaicb *list[1];
+	struct sigevent sev;
+	size_t hlen, plen;
+	int error;
+
+	qp = lua_newuserdatauv(L, sizeof(struct dnsquery *), 0);
+	*qp = NULL;
+	luaL_setmetatable(L, DNS_METATABLE);
+
+	hlen = strlen(host);
+	plen = strlen(port);
+	q = calloc(1, sizeof(struct dnsquery) + hlen + plen + 2);
+	if (q == NULL)
+		luaL_error(L, "memory error");
+	q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (q->efd == -1) {
+		free(q);
+		luaL_error(L, "eventfd: %s", strerror(errno));
+	}
+	memcpy(q->name, host, hlen + 1);
+	memcpy(q->name + hlen + 1, port, plen + 1);
+	q->hints.ai_socktype = type;
+	q->cb.ar_name = q->name;
+	q->cb.ar_service = q->name + hlen + 1;
+	q->cb.ar_request = &q->hints;
+	q->refs = 2;
+
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD;
+	sev.sigev_notify_function = dns_notify;
+	sev.sigev_value.sival_ptr = q;
+
+	list[0] = &q->cb;
+	error = getaddrinfo_a(GAI_NOWAIT, list, 1, &sev);
+	if (error) {
+		q->refs = 1;
+		dns_release(q);
+		luaL_error(L, "%s: %s", host, gai_strerror(error));
+	}
+	*qp = q;
+	return q;
+}
+
+/*
+ * Replace the completed query at the top of the stack by a cache entry.
+ * Returns the error of the lookup, the query is left in place on error.
+ */
+static int
+dns_finish(lua_State *L)
+{
+	struct dnsquery *q;
+	int error, key;
+
+	q = *(struct dnsquery **)lua_touserdata(L, -1);
+	error = gai_error(&q->cb);
+	if (error)
+		return error;
+
+	dns_pushkey(L, q->cb.ar_name, q->cb.ar_service, q->hints.ai_socktype);
+	key = lua_gettop(L);
+	dns_newentry(L, q->cb.ar_result);
+	dns_store(L, key);
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+	return 0;
+}
+
+/*
+ * Resolve host and port, using the cache.  On success the entry holding
+ * the result is pushed on the stack.  If async is set and the caller runs
+ * on a scheduler, a lookup that is not cached starts a query instead,
+ * pushes it, and returns EAI_INPROGRESS; the caller then yields until the
+ * eventfd of the query becomes readable.
+ */
+static int
+dns_getaddrinfo(lua_State *L, const char *host, const char *port, int type,
+    int async, struct addrinfo **res)
+{
+	struct addrinfo hints, *res0;
+	struct dnsentry *e;
+	int error, key;
+
+	dns_pushkey(L, host, port, type);
+	key = lua_gettop(L);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, DNS_CACHE);
+	lua_pushvalue(L, key);
+	if (lua_rawget(L, -2) == LUA_TUSERDATA) {
+		e = lua_touserdata(L, -1);
+		if (e->expires > sock_now()) {
+			lua_replace(L, key);
+			lua_pop(L, 1);
+			*res = e->ai;
+			return 0;
+		}
+	}
+	lua_pop(L, 2);
+
+	if (async && sched_active(L)) {
+		dns_query(L, host, port, type);
+		lua_remove(L, key);
+		return EAI_INPROGRESS;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = type;
+	error = getaddrinfo(host, port, &hints, &res0);
+	if (error) {
+		lua_pop(L, 1);
+		return error;
+	}
+	e = dns_newentry(L, res0);
+	freeaddrinfo(res0);
+	dns_store(L, key);
+	lua_replace(L, key);
+	*res = e->ai;
+	return 0;
+}
+
+/* Yield until the query on top of the stack has completed */
+static int
+dns_wait(lua_State *L, lua_KContext ctx, lua_KFunction k)
+{
+	struct dnsquery *q;
+
+	q = *(struct dnsquery **)lua_touserdata(L, -1);
+	lua_pushlightuserdata(L, &sched_marker);
+	lua_pushinteger(L, q->efd);
+	lua_pushinteger(L, POLLIN);
+	lua_pushinteger(L, -1);
+	return lua_yieldk(L, 4, ctx, k);
+}
+
+static int
+dns_pushaddrs(lua_State *L, struct addrinfo *res0)
+{
+	struct addrinfo *res;
+	int n;
+
+	lua_newtable(L);
+	for (n = 1, res = res0; res; res = res->ai_next, n++) {
+		luanet_pushaddr(L, res->ai_addr, res->ai_addrlen);
+		lua_rawseti(L, -2, n);
+	}
+	return 1;
+}
+
+static int
+resolve_k(lua_State *L, int status, lua_KContext ctx)
+{
+	struct dnsentry *e;
+	int error;
+
+	lua_pop(L, 1);
+	error = dns_finish(L);
+	if (error) {
+		lua_pushnil(L);
+		lua_pushstring(L, gai_strerror(error));
+		return 2;
+	}
+	e = lua_touserdata(L, -1);
+	return dns_pushaddrs(L, e->ai);
+}
+
+/*
+ * Resolve host and port to an array of addresses.  Inside a scheduler
+ * coroutine, lookups that are not cached do not block the scheduler.
+ */
+static int
+luanet_resolve(lua_State *L)
+{
+	struct addrinfo *res;
+	const char *host, *port;
+	int error;
+
+	host = luaL_checkstring(L, 1);
+	port = luaL_checkstring(L, 2);
+	lua_settop(L, 2);
+
+	error = dns_getaddrinfo(L, host, port, SOCK_STREAM, 1, &res);
+	if (error == EAI_INPROGRESS)
+		return dns_wait(L, 0, resolve_k);
+	if (error) {
+		lua_pushnil(L);
+		lua_pushstring(L, gai_strerror(error));
+		return 2;
+	}
+	return dns_pushaddrs(L, res);
+}
+
+/*
+ * Start an asynchronous lookup for use with an event loop, which waits for
+ * the descriptor returned by query:fd() to become readable and then calls
+ * query:result().
+ */
+static int
+luanet_lookup(lua_State *L)
+{
+	dns_query(L, luaL_checkstring(L, 1), luaL_checkstring(L, 2),
+	    SOCK_STREAM);
+	return 1;
+}
+
+static int
+luanet_dns_fd(lua_State *L)
+{
+	struct dnsquery **qp;
+
+	qp = luaL_checkudata(L, 1, DNS_METATABLE);
+	if (*qp == NULL)
+		return luaL_error(L, "query is closed");
+	lua_pushinteger(L, (*qp)->efd);
+	return 1;
+}
+
+static int
+luanet_dns_result(lua_State *L)
+{
+	struct dnsquery **qp;
+	struct dnsentry *e;
+	int error;
+
+	qp = luaL_checkudata(L, 1, DNS_METATABLE);
+	if (*qp == NULL)
+		return luaL_error(L, "query is closed");
+	lua_settop(L, 1);
+
+	error = dns_finish(L);
+	if (error) {
+		lua_pushnil(L);
+		lua_pushstring(L, gai_strerror(error));
+		return 2;
+	}
+	e = lua_touserdata(L, -1);
+	return dns_pushaddrs(L, e->ai);
+}
+
+static int
+luanet_dns_close(lua_State *L)
+{
+	struct dnsquery **qp;
+
+	qp = luaL_checkudata(L, 1, DNS_METATABLE);
+	if (*qp != NULL) {
+		/* a cancelled query is never notified */
+		if (gai_cancel(&(*qp)->cb) == EAI_CANCELED)
+			dns_release(*qp);
+		dns_release(*qp);
+		*qp = NULL;
+	}
+	return 0;
+}
+
+/* Set the lifetime of cached results, 0 disables the cache */
+static int
+luanet_dnsttl(lua_State *L)
+{
+	lua_pushinteger(L, dnsttl);
+	if (!lua_isnoneornil(L, 1)) {
+		dnsttl = luaL_checkinteger(L, 1);
+		lua_newtable(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, DNS_CACHE);
+	}
+	return 1;
+}
+
+static int
+net_bind(lua_State *L, int type)
+{
+	struct addrinfo *res, *res0;
+	struct sockaddr_un addr;
+	socklen_t len;
+	int fd, error, opts, backlog;
+	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+	const char *port, *host;
+
+	host = luaL_checkstring(L, 1);
+	opts = lua_gettop(L) > 1 && lua_istable(L, lua_gettop(L)) ?
+	    lua_gettop(L) : 0;
+
+	if (sock_isunix(host)) {
+		type = sock_unixtype(L, opts, type);
+		fd = socket(AF_UNIX, type, 0);
+
+		if (fd < 0)
+			return luaL_error(L, "connection error");
+
+		if (sock_unixaddr(host, &addr, &len)
+		    || sock_setopts(L, opts, fd)
+		    || bind(fd, (struct sockaddr *)&addr, len) == -1) {
+			close(fd);
+			return luaL_error(L, "bind error");
+		}
+
+		if (type != SOCK_DGRAM && listen(fd, opts == 2 ? 32 :
+		    luaL_optinteger(L, 2, 32))) {
+			close(fd);
+			return luaL_error(L, "listen error");
+		}
+
+	} else {
+		port = luaL_checkstring(L, 2);
+		backlog = opts == 3 ? 32 : luaL_optinteger(L, 3, 32);
+
+		error = dns_getaddrinfo(L, host, port, type, 0, &res0);
+		if (error)
+			return luaL_error(L, "%s: %s", host,
+			    gai_strerror(error));
+		fd = -1;
+		for (res = res0; res; res = res->ai_next) {
+			error = getnameinfo(res->ai_addr, res->ai_addrlen, hbuf,
+			    sizeof(hbuf), sbuf, sizeof(sbuf), NI_NUMERICHOST |
+			    NI_NUMERICSERV);
+			if (error)
+				continue;
+			fd = socket(res->ai_family, res->ai_socktype,
+			    res->ai_protocol);
+			if (fd < 0)
+				continue;
+			if (sock_setopts(L, opts, fd)
+			    || bind(fd, res->ai_addr, res->ai_addrlen) < 0) {
+				close(fd);
+				fd = -1;
+				continue;
+			}
+			break;
+		}
+
+		if (fd < 0)
+			return luaL_error(L, "connection error");
+
+		if (type == SOCK_STREAM && listen(fd, backlog)) {
+			close(fd);
+			return luaL_error(L, "listen error");
+		}
+
+		if (opts) {
+			if (lua_getfield(L, opts, "cpusteer") != LUA_TNIL
+			    && sock_cpusteer(fd, lua_tointeger(L, -1))) {
+				close(fd);
+				return luaL_error(L, "cpusteer error");
+			}
+			lua_pop(L, 1);
+		}
+	}
+	luanet_pushsocket(L, fd);
+	return 1;
+}
+
+/*
+ * Connection attempts of a connect(), racing the address families as
+ * described in RFC 8305.  The addresses point into the cache entry, which
+ * the caller keeps on the stack.
+ */
+struct eyeballs {
+	struct addrinfo	*ai[NET_MAXATTEMPTS];	/* interleaved addresses */
+	struct pollfd	 pfd[NET_MAXATTEMPTS];	/* attempts in progress */
+	long long	 started[NET_MAXATTEMPTS];
+	long long	 start;		/* when connect() was called */
+	long long	 last;		/* when the latest attempt started */
+	int		 nai;
+	int		 next;		/* next address to try */
+	int		 npfd;
+	int		 timeout;
+	int		 delay;
+	int		 lasterr;
+	int		 epfd;		/* watched by a scheduler or -1 */
+};
+
+/*
+ * Reorder the addresses to alternate between the families, starting with
+ * the family of the first result.
+ */
+static void
+eyeballs_init(struct eyeballs *eb, struct addrinfo *res0, int timeout,
+    int delay)
+{
+	struct addrinfo *res;
+	struct addrinfo *pri[NET_MAXATTEMPTS], *sec[NET_MAXATTEMPTS];
+	int i, np, ns, family;
+
+	family = res0->ai_family;
+	np = ns = 0;
+	for (res = res0; res; res = res->ai_next)
+		if (res->ai_family == family && np < NET_MAXATTEMPTS)
+			pri[np++] = res;
+		else if (res->ai_family != family && ns < NET_MAXATTEMPTS)
+			sec[ns++] = res;
+	for (i = eb->nai = 0; eb->nai < NET_MAXATTEMPTS && (i < np || i < ns);
+	    i++) {
+		if (i < np)
+			eb->ai[eb->nai++] = pri[i];
+		if (i < ns && eb->nai < NET_MAXATTEMPTS)
+			eb->ai[eb->nai++] = sec[i];
+	}
+
+	eb->npfd = eb->next = 0;
+	eb->timeout = timeout;
+	eb->delay = delay;
+	eb->lasterr = ECONNREFUSED;
+	eb->start = sock_now();
+	eb->last = eb->start - delay;
+	eb->epfd = -1;
+}
+
+/* Abandon the attempts still in progress */
+static void
+eyeballs_close(struct eyeballs *eb)
+{
+	int i;
+
+	for (i = 0; i < eb->npfd; i++)
+		close(eb->pfd[i].fd);
+	eb->npfd = 0;
+	if (eb->epfd >= 0) {
+		close(eb->epfd);
+		eb->epfd = -1;
+	}
+}
+
+static int
+eyeballs_gc(lua_State *L)
+{
+	eyeballs_close(luaL_checkudata(L, 1, EYEBALLS_METATABLE));
+	return 0;
+}
+
+/* Add an attempt to the epoll instance watched by a scheduler */
+static int
+eyeballs_watch(struct eyeballs *eb, int fd)
+{
+	struct epoll_event ev;
+
+	if (eb->epfd == -1)
+		return 0;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLOUT;
+	ev.data.fd = fd;
+	return epoll_ctl(eb->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * Start a new non-blocking connect if none is in progress, if delay
+ * milliseconds have passed since the last one started or as soon as an
+ * attempt fails.  Returns a socket that connected at once or -1.
+ */
+static int
+eyeballs_start(lua_State *L, struct eyeballs *eb, int opts)
+{
+	struct addrinfo *res;
+	long long now;
+	int fd;
+
+	now = sock_now();
+	while (eb->next < eb->nai && (eb->npfd == 0
+	    || now - eb->last >= eb->delay)) {
+		res = eb->ai[eb->next++];
+		fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK |
+		    SOCK_CLOEXEC, res->ai_protocol);
+		if (fd == -1) {
+			eb->lasterr = errno;
+			continue;
+		}
+		if (sock_setopts(L, opts, fd) == 0
+		    && connect(fd, res->ai_addr, res->ai_addrlen) == 0)
+			return fd;
+		if (errno != EINPROGRESS || eyeballs_watch(eb, fd) == -1) {
+			/* failed attempts make room for the next at once */
+			eb->lasterr = errno;
+			close(fd);
+			eb->last = now - eb->delay;
+			continue;
+		}
+		eb->pfd[eb->npfd].fd = fd;
+		eb->pfd[eb->npfd].events = POLLOUT;
+		eb->pfd[eb->npfd].revents = 0;
+		eb->started[eb->npfd++] = now;
+		eb->last = now;
+	}
+	return -1;
+}
+
+/* Milliseconds until the next attempt or the earliest timeout, or -1 */
+static int
+eyeballs_wait(struct eyeballs *eb)
+{
+	long long now;
+	int i, n, ms;
+
+	now = sock_now();
+	ms = -1;
+	if (eb->next < eb->nai) {
+		n = eb->delay - (int)(now - eb->last);
+		ms = n < 0 ? 0 : n;
+	}
+	if (eb->timeout >= 0)
+		for (i = 0; i < eb->npfd; i++) {
+			n = eb->timeout - (int)(now - eb->started[i]);
+			if (n < 0)
+				n = 0;
+			if (ms == -1 || n < ms)
+				ms = n;
+		}
+	return ms;
+}
+
+/*
+ * Look at the attempts poll() reported on, abandon those that failed or
+ * timed out.  Returns the first socket that connected or -1.
+ */
+static int
+eyeballs_check(struct eyeballs *eb)
+{
+	socklen_t len;
+	long long now;
+	int i, fd, error;
+
+	now = sock_now();
+	for (i = eb->npfd - 1; i >= 0; i--) {
+		if (eb->pfd[i].revents) {
+			len = sizeof(error);
+			if (getsockopt(eb->pfd[i].fd, SOL_SOCKET, SO_ERROR,
+			    &error, &len) == -1)
+				error = errno;
+			if (error == 0) {
+				fd = eb->pfd[i].fd;
+				eb->pfd[i] = eb->pfd[--eb->npfd];
+				eb->started[i] = eb->started[eb->npfd];
+				return fd;
+			}
+			eb->lasterr = error;
+		} else if (eb->timeout >= 0
+		    && now - eb->started[i] >= eb->timeout)
+			eb->lasterr = ETIMEDOUT;
+		else
+			continue;
+
+		/* failed attempts make room for the next at once */
+		close(eb->pfd[i].fd);
+		eb->pfd[i] = eb->pfd[--eb->npfd];
+		eb->started[i] = eb->started[eb->npfd];
+		eb->last = now - eb->delay;
+	}
+	return -1;
+}
+
+/*
+ * Connect to the first reachable address.  A new non-blocking connect is
+ * started every delay milliseconds, or as soon as an attempt fails, while
+ * earlier attempts remain in progress.  Attempts still in progress after
+ * timeout milliseconds are abandoned.  Returns the connected socket or -1
+ * with the error in eb->lasterr.
+ */
+static int
+sock_eyeballs(lua_State *L, struct eyeballs *eb, int opts)
+{
+	int fd;
+
+	for (;;) {
+		if ((fd = eyeballs_start(L, eb, opts)) != -1 || eb->npfd == 0)
+			break;
+		if (poll(eb->pfd, eb->npfd, eyeballs_wait(eb)) == -1) {
+			if (errno == EINTR)
+				continue;
+			eb->lasterr = errno;
+			break;
+		}
+		if ((fd = eyeballs_check(eb)) != -1)
+			break;
+	}
+	eyeballs_close(eb);
+	return fd;
+}
+
+/*
+ * Return the connected socket and the milliseconds it took to connect or
+ * raise the error of the last attempt.  The socket stays non-blocking if
+ * the calling coroutine runs in a scheduler.
+ */
+static int
+eyeballs_result(lua_State *L, struct eyeballs *eb, int fd, int nonblock)
+{
+	struct socket *s;
+	int flags;
+
+	eyeballs_close(eb);
+	if (fd == -1)
+		return luaL_error(L, "%s: %s", lua_tostring(L, 1),
+		    strerror(eb->lasterr));
+
+	if (!nonblock && (flags = fcntl(fd, F_GETFL)) != -1)
+		fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+	s = luanet_pushsocket(L, fd);
+	s->nonblock = nonblock;
+	lua_pushinteger(L, sock_now() - eb->start);
+	return 2;
+}
+
+static int sched_eyeballs(lua_State *, int);
+
+/*
+ * An attempt has completed, or it is time to start the next one or to
+ * abandon one.  ctx is the stack index of the attempts.
+ */
+static int
+sched_eyeballs_k(lua_State *L, int status, lua_KContext ctx)
+{
+	struct eyeballs *eb;
+	int fd, n;
+
+	/* the timer only paces the attempts, timeouts are checked below */
+	lua_pop(L, 1);
+
+	eb = lua_touserdata(L, ctx);
+	do
+		n = poll(eb->pfd, eb->npfd, 0);
+	while (n == -1 && errno == EINTR);
+	if (n == -1) {
+		eb->lasterr = errno;
+		return eyeballs_result(L, eb, -1, 1);
+	}
+	if ((fd = eyeballs_check(eb)) != -1)
+		return eyeballs_result(L, eb, fd, 1);
+	return sched_eyeballs(L, ctx);
+}
+
+/*
+ * Race the connection attempts at stack index idx within a scheduler.
+ * The attempts in progress are added to an epoll instance, the calling
+ * coroutine yields until it becomes readable or it is time to start the
+ * next attempt, while other coroutines keep running.
+ */
+static int
+sched_eyeballs(lua_State *L, int idx)
+{
+	struct eyeballs *eb;
+	int fd;
+
+	eb = lua_touserdata(L, idx);
+	fd = eyeballs_start(L, eb, lua_istable(L, 3) ? 3 : 0);
+	if (fd != -1 || eb->npfd == 0)
+		return eyeballs_result(L, eb, fd, 1);
+
+	lua_pushlightuserdata(L, &sched_marker);
+	lua_pushinteger(L, eb->epfd);
+	lua_pushinteger(L, POLLIN);
+	lua_pushinteger(L, eyeballs_wait(eb));
+	return lua_yieldk(L, 4, idx, sched_eyeballs_k);
+}
+
+/*
+ * Connect to the resolved addresses res0.  The stack holds host, port and
+ * the options, or nil, followed by the cache entry holding res0.
+ */
+static int
+net_connect_addrs(lua_State *L, int type, struct addrinfo *res0)
+{
+	struct eyeballs *eb;
+	struct addrinfo *res;
+	int fd, error, opts, timeout, delay;
+	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+
+	opts = lua_istable(L, 3) ? 3 : 0;
+
+	if (type == SOCK_STREAM) {
+		timeout = -1;
+		delay = NET_CONNDELAY;
+		if (opts) {
+			lua_getfield(L, opts, "timeout");
+			timeout = luaL_optinteger(L, -1, -1);
+			lua_getfield(L, opts, "delay");
+			delay = luaL_optinteger(L, -1, NET_CONNDELAY);
+			lua_pop(L, 2);
+		}
+
+		/* the userdata abandons the attempts should we never resume */
+		eb = lua_newuserdatauv(L, sizeof(struct eyeballs), 0);
+		eyeballs_init(eb, res0, timeout, delay);
+		luaL_setmetatable(L, EYEBALLS_METATABLE);
+
+		if (sched_active(L)) {
+			eb->epfd = epoll_create1(EPOLL_CLOEXEC);
+			if (eb->epfd == -1)
+				return luaL_error(L, "epoll_create1: %s",
+				    strerror(errno));
+			return sched_eyeballs(L, lua_gettop(L));
+		}
+		return eyeballs_result(L, eb, sock_eyeballs(L, eb, opts), 0);
+	}
+
+	fd = -1;
+	for (res = res0; res; res = res->ai_next) {
+		error = getnameinfo(res->ai_addr, res->ai_addrlen, hbuf,
+		    sizeof(hbuf), sbuf, sizeof(sbuf), NI_NUMERICHOST |
+		    NI_NUMERICSERV);
+		if (error)
+			continue;
+		fd = socket(res->ai_family, res->ai_socktype,
+		    res->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (sock_setopts(L, opts, fd)
+		    || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+			close(fd);
+			fd = -1;
+			continue;
+		}
+		break;
+	}
+	if (fd < 0)
+		return luaL_error(L, "connection error");
+	luanet_pushsocket(L, fd);
+	return 1;
+}
+
+/* The asynchronous lookup of a connect has completed */
+static int
+net_connect_k(lua_State *L, int status, lua_KContext ctx)
+{
+	struct dnsentry *e;
+	int error;
+
+	lua_pop(L, 1);
+	error = dns_finish(L);
+	if (error)
+		return luaL_error(L, "%s: %s", lua_tostring(L, 1),
+		    gai_strerror(error));
+	e = lua_touserdata(L, -1);
+	return net_connect_addrs(L, ctx, e->ai);
+}
+
+static int
+net_connect(lua_State *L, int type)
+{
+	struct addrinfo *res0;
+	struct sockaddr_un addr;
+	socklen_t len;
+	int fd, error, opts;
+	const char *port, *host;
+
+	host = luaL_checkstring(L, 1);
+	opts = lua_gettop(L) > 1 && lua_istable(L, lua_gettop(L)) ?
+	    lua_gettop(L) : 0;
+
+	if (sock_isunix(host)) {
+		fd = socket(AF_UNIX, sock_unixtype(L, opts, type), 0);
+
+		if (fd >= 0) {
+			if (sock_unixaddr(host, &addr, &len)
+			    || sock_setopts(L, opts, fd)
+			    || connect(fd, (struct sockaddr *)&addr, len) == -1) {
+				close(fd);
+				return luaL_error(L, "connect error");
+			}
+		}
+		if (fd < 0)
+			return luaL_error(L, "connection error");
+		luanet_pushsocket(L, fd);
+		return 1;
+	}
+
+	port = luaL_checkstring(L, 2);
+	lua_settop(L, 3);
+
+	error = dns_getaddrinfo(L, host, port, type, type == SOCK_STREAM,
+	    &res0);
+	if (error == EAI_INPROGRESS)
+		return dns_wait(L, type, net_connect_k);
+	if (error)
+		return luaL_error(L, "%s: %s", host, gai_strerror(error));
+	return net_connect_addrs(L, type, res0);
+}
+
+/* Wrap an existing descriptor, e.g. one returned by linux.uring */
+static int
+luanet_fromfd(lua_State *L)
+{
+	luanet_pushsocket(L, luaL_checkinteger(L, 1));
+	return 1;
+}
+
+/* Create a pair of connected AF_UNIX sockets, e.g. to talk to a worker */
+static int
+luanet_socketpair(lua_State *L)
+{
+	int fd[2], type;
+
+	type = unix_types[luaL_checkoption(L, 1, "stream", unix_typenames)];
+	if (socketpair(AF_UNIX, type, 0, fd)) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	luanet_pushsocket(L, fd[0]);
+	luanet_pushsocket(L, fd[1]);
+	return 2;
+}
+
+static int
+luanet_bind(lua_State *L)
+{
+	return net_bind(L, SOCK_STREAM);
+}
+
+static int
+luanet_connect(lua_State *L)
+{
+	return net_connect(L, SOCK_STREAM);
+}
+
+static int
+luanet_udpbind(lua_State *L)
+{
+	return net_bind(L, SOCK_DGRAM);
+}
+
+static int
+luanet_udpconnect(lua_State *L)
+{
+	return net_connect(L, SOCK_DGRAM);
+}
+
+static int
+luanet_print(lua_State *L)
+{
+	struct socket *s;
+	struct iovec iov[2];
+	size_t skip;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	iov[0].iov_base = (void *)luaL_checklstring(L, 2, &iov[0].iov_len);
+	iov[1].iov_base = "\n";
+	iov[1].iov_len = 1;
+	skip = s->wdone;
+	switch (sock_writev(L, s, iov, 2, 0, &skip)) {
+	case SOCK_WOULDBLOCK:
+		return sched_block(L, s->fd, POLLOUT, sock_timeout(s, -1),
+		    luanet_print);
+	case -1:
+		s->wdone = 0;
+		return luaL_error(L, "error printing data");
+	}
+	s->wdone = 0;
+	return 0;
+}
+
+/* Return up to len bytes, only reading from the socket if none are buffered */
+static int
+luanet_read(lua_State *L)
+{
+	struct socket *s;
+	size_t len, avail;
+	int timeout;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	len = luaL_checkinteger(L, 2);
+	timeout = luaL_optinteger(L, 3, -1);
+
+	if (s->rpos == s->rend) {
+		switch (sock_fill(L, s, timeout)) {
+		case SOCK_WOULDBLOCK:
+			return sched_block(L, s->fd, POLLIN,
+			    sock_timeout(s, timeout), luanet_read);
+		case 0:
+		case -1:
+			lua_pushnil(L);
+			return 1;
+		}
+	}
+	avail = s->rend - s->rpos;
+	if (len > avail)
+		len = avail;
+	lua_pushlstring(L, s->rbuf + s->rpos, len);
+	s->rpos += len;
+	return 1;
+}
+
+static int
+luanet_readln(lua_State *L)
+{
+	return sock_pushuntil(L, luaL_checkudata(L, 1, SOCKET_METATABLE),
+	    "\n", 1, luaL_optinteger(L, 2, -1), luanet_readln);
+}
+
+static int
+luanet_read_until(lua_State *L)
+{
+	const char *delim;
+	size_t dlen;
+
+	delim = luaL_checklstring(L, 2, &dlen);
+	luaL_argcheck(L, dlen > 0, 2, "empty delimiter");
+	return sock_pushuntil(L, luaL_checkudata(L, 1, SOCKET_METATABLE),
+	    delim, dlen, luaL_optinteger(L, 3, -1), luanet_read_until);
+}
+
+/*
+ * Return an array with all complete lines that are buffered, reading from
+ * the socket only if there is not a single one.  A pipelined burst of
+ * requests is thus handled in one call.
+ */
+static int
+luanet_readlines(lua_State *L)
+{
+	struct socket *s;
+	lua_Integer max, n;
+	size_t avail, scanned;
+	char *p, *nl;
+	int timeout;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	max = luaL_optinteger(L, 2, 0);
+	timeout = luaL_optinteger(L, 3, -1);
+
+	for (scanned = 0; ; scanned = avail) {
+		avail = s->rend - s->rpos;
+		if (avail > scanned && memchr(s->rbuf + s->rpos + scanned,
+		    '\n', avail - scanned) != NULL)
+			break;
+		switch (sock_fill(L, s, timeout)) {
+		case SOCK_WOULDBLOCK:
+			return sched_block(L, s->fd, POLLIN,
+			    sock_timeout(s, timeout), luanet_readlines);
+		case 0:
+		case -1:
+			lua_pushnil(L);
+			return 1;
+		}
+	}
+
+	lua_newtable(L);
+	for (n = 1, p = s->rbuf + s->rpos; max <= 0 || n <= max; n++) {
+		nl = memchr(p, '\n', s->rbuf + s->rend - p);
+		if (nl == NULL)
+			break;
+		lua_pushlstring(L, p, nl - p);
+		lua_rawseti(L, -2, n);
+		p = nl + 1;
+	}
+	s->rpos = p - s->rbuf;
+	return 1;
+}
+
+/*
+ * Decode the length of a frame at p.  Returns the size of the header, 0
+ * if the header is incomplete or -1 if it is invalid.
+ */
+static int
+frame_decode(int framing, const unsigned char *p, size_t avail,
+    uint64_t *len)
+{
+	size_t n;
+
+	*len = 0;
+	if (framing == FRAME_VARINT) {
+		for (n = 0; n < avail && n < 10; n++) {
+			*len |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+			if (!(p[n] & 0x80))
+				return n + 1;
+		}
+		return n == 10 ? -1 : 0;
+	}
+
+	if (avail < (size_t)framing)
+		return 0;
+	for (n = 0; n < (size_t)framing; n++)
+		*len = *len << 8 | p[n];
+	return framing;
+}
+
+static int
+frame_encode(int framing, uint64_t len, unsigned char *p)
+{
+	int n;
+
+	if (framing == FRAME_VARINT) {
+		n = 0;
+		do {
+			p[n] = len & 0x7f;
+			len >>= 7;
+			if (len)
+				p[n] |= 0x80;
+			n++;
+		} while (len);
+		return n;
+	}
+
+	for (n = framing - 1; n >= 0; n--) {
+		p[n] = len & 0xff;
+		len >>= 8;
+	}
+	return len ? -1 : framing;
+}
+
+/*
+ * Check for a complete frame in the read buffer.  Returns 1 and sets the
+ * header and payload length if there is one, 0 if more data is needed and
+ * -1 if the frame is invalid or larger than maxlen.
+ */
+static int
+frame_peek(struct socket *s, uint64_t maxlen, int *hdr, uint64_t *len)
+{
+	size_t avail;
+
+	avail = s->rend - s->rpos;
+	*hdr = frame_decode(s->framing, (unsigned char *)s->rbuf + s->rpos,
+	    avail, len);
+	if (*hdr < 0 || *len > maxlen)
+		return -1;
+	return *hdr > 0 && avail - *hdr >= *len;
+}
+
+/* Read one length-prefixed frame of at most maxlen bytes */
+static int
+luanet_read_frame(lua_State *L)
+{
+	struct socket *s;
+	uint64_t maxlen, len;
+	int hdr, timeout;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	maxlen = luaL_optinteger(L, 2, NET_MAXFRAME);
+	timeout = luaL_optinteger(L, 3, -1);
+
+	for (;;) {
+		switch (frame_peek(s, maxlen, &hdr, &len)) {
+		case -1:
+			lua_pushnil(L);
+			lua_pushliteral(L, "invalid or oversized frame");
+			return 2;
+		case 1:
+			lua_pushlstring(L, s->rbuf + s->rpos + hdr, len);
+			s->rpos += hdr + len;
+			return 1;
+		}
+		switch (sock_fill(L, s, timeout)) {
+		case SOCK_WOULDBLOCK:
+			return sched_block(L, s->fd, POLLIN,
+			    sock_timeout(s, timeout), luanet_read_frame);
+		case 0:
+		case -1:
+			lua_pushnil(L);
+			return 1;
+		}
+	}
+}
+
+/*
+ * Return all complete frames, at most max if max is greater than zero,
+ * waiting only if none has been received yet.  An invalid or oversized
+ * frame ends the array; it is reported by the next call.
+ */
+static int
+luanet_read_frames(lua_State *L)
+{
+	struct socket *s;
+	uint64_t maxlen, len;
+	lua_Integer max, n;
+	int hdr, timeout;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	maxlen = luaL_optinteger(L, 2, NET_MAXFRAME);
+	max = luaL_optinteger(L, 3, 0);
+	timeout = luaL_optinteger(L, 4, -1);
+
+	for (;;) {
+		switch (frame_peek(s, maxlen, &hdr, &len)) {
+		case -1:
+			lua_pushnil(L);
+			lua_pushliteral(L, "invalid or oversized frame");
+			return 2;
+		case 0:
+			switch (sock_fill(L, s, timeout)) {
+			case SOCK_WOULDBLOCK:
+				return sched_block(L, s->fd, POLLIN,
+				    sock_timeout(s, timeout),
+				    luanet_read_frames);
+			case 0:
+			case -1:
+				lua_pushnil(L);
+				return 1;
+			}
+			continue;
+		}
+		break;
+	}
+
+	lua_newtable(L);
+	for (n = 1; (max <= 0 || n <= max)
+	    && frame_peek(s, maxlen, &hdr, &len) == 1; n++) {
+		lua_pushlstring(L, s->rbuf + s->rpos + hdr, len);
+		lua_rawseti(L, -2, n);
+		s->rpos += hdr + len;
+	}
+	return 1;
+}
+
+/* Write a string or the contents of a linux.buffer as one frame */
+static int
+luanet_write_frame(lua_State *L)
+{
+	struct socket *s;
+	struct buffer *b;
+	struct iovec iov[2];
+	unsigned char hdr[10];
+	size_t skip;
+	int n;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	if ((b = luaL_testudata(L, 2, BUFFER_METATABLE)) != NULL) {
+		iov[1].iov_base = b->data;
+		iov[1].iov_len = b->len;
+	} else
+		iov[1].iov_base = (void *)luaL_checklstring(L, 2,
+		    &iov[1].iov_len);
+
+	n = frame_encode(s->framing, iov[1].iov_len, hdr);
+	if (n == -1)
+		return luaL_argerror(L, 2, "frame too large for the header");
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = n;
+
+	skip = s->wdone;
+	switch (sock_writev(L, s, iov, 2, 0, &skip)) {
+	case SOCK_WOULDBLOCK:
+		return sched_block(L, s->fd, POLLOUT, sock_timeout(s, -1),
+		    luanet_write_frame);
+	case -1:
+		s->wdone = 0;
+		return luaL_error(L, "error writing data");
+	}
+	s->wdone = 0;
+	return 0;
+}
+
+/*
+ * Set the frame header to 1, 2, 4 or 8 bytes or to "varint".  Returns the
+ * previous setting.
+ */
+static int
+luanet_framing(lua_State *L)
+{
+	struct socket *s;
+	int framing;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	if (s->framing == FRAME_VARINT)
+		lua_pushliteral(L, "varint");
+	else
+		lua_pushinteger(L, s->framing);
+
+	if (lua_type(L, 2) == LUA_TSTRING) {
+		luaL_argcheck(L, !strcmp(lua_tostring(L, 2), "varint"), 2,
+		    "invalid framing");
+		s->framing = FRAME_VARINT;
+	} else if (!lua_isnoneornil(L, 2)) {
+		framing = luaL_checkinteger(L, 2);
+		luaL_argcheck(L, framing == 1 || framing == 2 || framing == 4
+		    || framing == 8, 2, "invalid framing");
+		s->framing = framing;
+	}
+	return 1;
+}
+
+/*
+ * Return the length of a header block terminated by an empty line,
+ * including that line, or 0 if the block is incomplete.
+ */
+static size_t
+header_end(const char *p, size_t len)
+{
+	const char *line, *nl, *end = p + len;
+
+	for (line = p; (nl = memchr(line, '\n', end - line)) != NULL;
+	    line = nl + 1)
+		if (nl == line || (nl == line + 1 && *line == '\r'))
+			return nl + 1 - p;
+	return 0;
+}
+
+/*
+ * Parse a header line into a lower case name and a value without
+ * surrounding whitespace and add it to the table on top of the stack.
+ * Repeated fields are joined with commas.
+ */
+static int
+header_parse(lua_State *L, const char *line, size_t len)
+{
+	luaL_Buffer b;
+	const char *colon, *v, *end = line + len;
+	size_t n;
+
+	colon = memchr(line, ':', len);
+	if (colon == NULL || colon == line)
+		return -1;
+	for (v = line; v < colon; v++)
+		if (isspace((unsigned char)*v) || iscntrl((unsigned char)*v))
+			return -1;
+
+	luaL_buffinit(L, &b);
+	for (v = line; v < colon; v++)
+		luaL_addchar(&b, tolower((unsigned char)*v));
+	luaL_pushresult(&b);
+
+	for (v = colon + 1; v < end && (*v == ' ' || *v == '\t'); v++)
+		;
+	while (end > v && (end[-1] == ' ' || end[-1] == '\t'))
+		end--;
+	n = end - v;
+
+	lua_pushvalue(L, -1);
+	if (lua_rawget(L, -3) == LUA_TSTRING) {
+		lua_pushliteral(L, ", ");
+		lua_pushlstring(L, v, n);
+		lua_concat(L, 3);
+	} else {
+		lua_pop(L, 1);
+		lua_pushlstring(L, v, n);
+	}
+	lua_rawset(L, -3);
+	return 0;
+}
+
+/*
+ * Read an HTTP style header block of at most maxbytes bytes with at most
+ * maxcount fields.  Returns the request or status line and a table of
+ * fields keyed by lower case name, nil and an error message if the block
+ * is invalid or exceeds the limits, or nil on end of file or timeout.
+ */
+static int
+luanet_read_headers(lua_State *L)
+{
+	struct socket *s;
+	lua_Integer maxcount, count;
+	size_t maxbytes, blen, len;
+	const char *p, *nl, *end;
+	int timeout;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	maxbytes = luaL_optinteger(L, 2, NET_MAXHDRSIZE);
+	maxcount = luaL_optinteger(L, 3, NET_MAXHDRS);
+	timeout = luaL_optinteger(L, 4, -1);
+
+	for (;;) {
+		/* empty lines preceding a request are ignored */
+		while (s->rpos < s->rend && (s->rbuf[s->rpos] == '\r'
+		    || s->rbuf[s->rpos] == '\n'))
+			s->rpos++;
+		if (s->rpos < s->rend && (blen = header_end(s->rbuf + s->rpos,
+		    s->rend - s->rpos)) > 0)
+			break;
+		if (s->rend - s->rpos >= maxbytes) {
+			lua_pushnil(L);
+			lua_pushliteral(L, "header block too large");
+			return 2;
+		}
+		switch (sock_fill(L, s, timeout)) {
+		case SOCK_WOULDBLOCK:
+			return sched_block(L, s->fd, POLLIN,
+			    sock_timeout(s, timeout), luanet_read_headers);
+		case 0:
+		case -1:
+			lua_pushnil(L);
+			return 1;
+		}
+	}
+	if (blen > maxbytes) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "header block too large");
+		return 2;
+	}
+
+	p = s->rbuf + s->rpos;
+	end = p + blen;
+	nl = memchr(p, '\n', end - p);
+	len = nl - p;
+	if (len > 0 && p[len - 1] == '\r')
+		len--;
+	lua_pushlstring(L, p, len);
+
+	lua_newtable(L);
+	for (count = 0, p = nl + 1; (nl = memchr(p, '\n', end - p)) != NULL;
+	    p = nl + 1) {
+		len = nl - p;
+		if (len > 0 && p[len - 1] == '\r')
+			len--;
+		if (len == 0)
+			break;
+		if (++count > maxcount) {
+			lua_pushnil(L);
+			lua_pushliteral(L, "too many header fields");
+			return 2;
+		}
+		if (header_parse(L, p, len)) {
+			lua_pushnil(L);
+			lua_pushliteral(L, "malformed header field");
+			return 2;
+		}
+	}
+	s->rpos += blen;
+	return 2;
+}
+
+/* Like read(), but leave the data in the buffer */
+static int
+luanet_peek(lua_State *L)
+{
+	struct socket *s;
+	size_t len, avail;
+	int timeout;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	len = luaL_checkinteger(L, 2);
+	timeout = luaL_optinteger(L, 3, -1);
+
+	if (s->rpos == s->rend) {
+		switch (sock_fill(L, s, timeout)) {
+		case SOCK_WOULDBLOCK:
+			return sched_block(L, s->fd, POLLIN,
+			    sock_timeout(s, timeout), luanet_peek);
+		case 0:
+		case -1:
+			lua_pushnil(L);
+			return 1;
+		}
+	}
+	avail = s->rend - s->rpos;
+	lua_pushlstring(L, s->rbuf + s->rpos, len > avail ? avail : len);
+	return 1;
+}
+
+/* Number of bytes that can be read without touching the socket */
+static int
+luanet_pending(lua_State *L)
+{
+	struct socket *s;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	lua_pushinteger(L, s->rend - s->rpos);
+	return 1;
+}
+
+static int
+luanet_socket(lua_State *L)
+{
+	lua_pushinteger(L, *(int *)luaL_checkudata(L, 1, SOCKET_METATABLE));
+	return 1;
+}
+
+static int
+luanet_write(lua_State *L)
+{
+	struct socket *s;
+	struct iovec iov;
+	size_t skip;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	iov.iov_base = (void *)luaL_checklstring(L, 2, &iov.iov_len);
+	skip = s->wdone;
+	switch (sock_writev(L, s, &iov, 1, 0, &skip)) {
+	case SOCK_WOULDBLOCK:
+		return sched_block(L, s->fd, POLLOUT, sock_timeout(s, -1),
+		    luanet_write);
+	case -1:
+		s->wdone = 0;
+		return luaL_error(L, "error writing data");
+	}
+	s->wdone = 0;
+	return 0;
+}
+
+/*
+ * Append up to max bytes to a linux.buffer, reading directly into the
+ * buffer unless the socket has buffered data.  Returns the number of
+ * bytes read, or nil at end of file, on error or timeout.
+ */
+static int
+luanet_readinto(lua_State *L)
+{
+	struct socket *s;
+	struct buffer *b;
+	lua_Integer n;
+	size_t max;
+	int timeout;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	b = luaL_checkudata(L, 2, BUFFER_METATABLE);
+	n = luaL_optinteger(L, 3, NET_BUFSIZ);
+	timeout = luaL_optinteger(L, 4, -1);
+	luaL_argcheck(L, n >= 0, 3, "negative length");
+	max = n;
+	if (b->data == NULL)
+		return luaL_argerror(L, 2, "closed buffer");
+	if (b->pins > 0)
+		return luaL_argerror(L, 2, "buffer is being sent");
+
+	if (buffer_reserve(b, max))
+		return luaL_error(L, "memory error");
+
+	if (s->rpos < s->rend) {
+		n = s->rend - s->rpos;
+		if ((size_t)n > max)
+			n = max;
+		memcpy(b->data + b->len, s->rbuf + s->rpos, n);
+		s->rpos += n;
+		b->len += n;
+		lua_pushinteger(L, n);
+		return 1;
+	}
+
+	/* a blocking read can not time out */
+	if (sock_deadline(s, 0) || (timeout >= 0 && !s->nonblock
+	    && sock_poll(s, POLLIN, timeout) <= 0)) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	for (;;) {
+		n = read(s->fd, b->data + b->len, max);
+		sock_account(s, 0, n);
+		if (n >= 0 || (errno != EINTR && errno != EAGAIN))
+			break;
+		if (errno == EAGAIN) {
+			if (sched_active(L))
+				return sched_block(L, s->fd, POLLIN,
+				    sock_timeout(s, timeout), luanet_readinto);
+			if (sock_poll(s, POLLIN, timeout) <= 0)
+				break;
+		}
+	}
+	if (n <= 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+	b->len += n;
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+/*
+ * Write bytes i to j of a linux.buffer, with the index rules of
+ * string.sub().  Returns the number of bytes written.
+ */
+static int
+luanet_writefrom(lua_State *L)
+{
+	struct socket *s;
+	struct buffer *b;
+	struct iovec iov;
+	lua_Integer i, j;
+	size_t skip;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	b = luaL_checkudata(L, 2, BUFFER_METATABLE);
+	i = luaL_optinteger(L, 3, 1);
+	j = luaL_optinteger(L, 4, -1);
+
+	if (i < 0)
+		i = (size_t)-i > b->len ? 1 : (lua_Integer)b->len + i + 1;
+	else if (i == 0)
+		i = 1;
+	if (j < 0)
+		j = (lua_Integer)b->len + j + 1;
+	else if (j > (lua_Integer)b->len)
+		j = b->len;
+
+	if (i > j) {
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+	iov.iov_base = b->data + i - 1;
+	iov.iov_len = j - i + 1;
+
+	skip = s->wdone;
+	switch (sock_writev(L, s, &iov, 1, 0, &skip)) {
+	case SOCK_WOULDBLOCK:
+		return sched_block(L, s->fd, POLLOUT, sock_timeout(s, -1),
+		    luanet_writefrom);
+	case -1:
+		s->wdone = 0;
+		return luaL_error(L, "error writing data");
+	}
+	s->wdone = 0;
+	lua_pushinteger(L, iov.iov_len);
+	return 1;
+}
+
+/*
+ * Write all strings in an array with as few sendmsg() calls as possible,
+ * IOV_MAX strings at a time.  If the optional second argument is true,
+ * MSG_MORE is set to tell the kernel that more data is following.
+ */
+static int
+luanet_writev(lua_State *L)
+{
+	struct socket *s;
+	struct iovec iov[IOV_MAX];
+	lua_Integer nparts, first, n;
+	size_t skip, total;
+	int cnt, more;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	more = lua_toboolean(L, 3) ? MSG_MORE : 0;
+
+	nparts = lua_rawlen(L, 2);
+	skip = s->wdone;
+	for (first = 1; first <= nparts; first += cnt) {
+		for (cnt = 0, n = first; n <= nparts && cnt < IOV_MAX;
+		    n++, cnt++) {
+			/* the strings are kept alive by the table */
+			if (lua_rawgeti(L, 2, n) != LUA_TSTRING)
+				return luaL_error(L, "writev: element %d is "
+				    "not a string", (int)n);
+			iov[cnt].iov_base = (void *)lua_tolstring(L, -1,
+			    &iov[cnt].iov_len);
+			lua_pop(L, 1);
+		}
+		switch (sock_writev(L, s, iov, cnt,
+		    first + cnt <= nparts ? MSG_MORE : more, &skip)) {
+		case SOCK_WOULDBLOCK:
+			return sched_block(L, s->fd, POLLOUT,
+			    sock_timeout(s, -1), luanet_writev);
+		case -1:
+			s->wdone = 0;
+			return luaL_error(L, "error writing data");
+		}
+	}
+	total = s->wdone;
+	s->wdone = 0;
+	lua_pushinteger(L, total);
+	return 1;
+}
+
+/*
+ * Send a string or the contents of a linux.buffer as one message on a
+ * SOCK_SEQPACKET or SOCK_DGRAM socket.  The message is sent completely or
+ * not at all.  Returns the number of bytes sent or nil and an error
+ * message.
+ */
+static int
+luanet_send(lua_State *L)
+{
+	struct socket *s;
+	struct buffer *b;
+	const char *data;
+	size_t len;
+	ssize_t n;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	if ((b = luaL_testudata(L, 2, BUFFER_METATABLE)) != NULL) {
+		data = b->data;
+		len = b->len;
+	} else
+		data = luaL_checklstring(L, 2, &len);
+
+	if (sock_deadline(s, 1)) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	for (;;) {
+		n = send(s->fd, data, len, MSG_NOSIGNAL);
+		sock_account(s, 1, n);
+		if (n >= 0 || (errno != EINTR && errno != EAGAIN))
+			break;
+		if (errno == EAGAIN) {
+			if (sched_active(L))
+				return sched_block(L, s->fd, POLLOUT,
+				    sock_timeout(s, -1), luanet_send);
+			if (sock_poll(s, POLLOUT, -1) <= 0)
+				break;
+		}
+	}
+	if (n == -1) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+/*
+ * Receive one message from a SOCK_SEQPACKET or SOCK_DGRAM socket.  Data
+ * buffered by read() and friends is left alone.  A message longer than
+ * max bytes is truncated and its original length returned as second
+ * value.  Returns nil on timeout or at end of file, which on
+ * SOCK_SEQPACKET sockets can not be told apart from an empty message.
+ * Empty datagrams are returned as empty strings.
+ */
+static int
+luanet_recv(lua_State *L)
+{
+	struct socket *s;
+	lua_Integer max;
+	luaL_Buffer b;
+	socklen_t len;
+	ssize_t n;
+	char *buf;
+	int timeout, type;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	max = luaL_optinteger(L, 2, NET_BUFSIZ);
+	timeout = luaL_optinteger(L, 3, -1);
+	luaL_argcheck(L, max > 0, 2, "message size must be positive");
+
+	/* MSG_TRUNC discards stream data instead of copying it */
+	len = sizeof(type);
+	if (getsockopt(s->fd, SOL_SOCKET, SO_TYPE, &type, &len) == -1)
+		return luaL_error(L, "getsockopt: %s", strerror(errno));
+	luaL_argcheck(L, type == SOCK_DGRAM || type == SOCK_SEQPACKET, 1,
+	    "not a datagram or seqpacket socket");
+
+	lua_settop(L, 3);
+	buf = luaL_buffinitsize(L, &b, max);
+
+	/* a blocking read can not time out */
+	if (sock_deadline(s, 0) || (timeout >= 0 && !s->nonblock
+	    && sock_poll(s, POLLIN, timeout) <= 0)) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	for (;;) {
+		n = recv(s->fd, buf, max, MSG_TRUNC);
+		sock_account(s, 0, n > max ? max : n);
+		if (n >= 0 || (errno != EINTR && errno != EAGAIN))
+			break;
+		if (errno == EAGAIN) {
+			if (sched_active(L)) {
+				lua_settop(L, 3);
+				return sched_block(L, s->fd, POLLIN,
+				    sock_timeout(s, timeout), luanet_recv);
+			}
+			if (sock_poll(s, POLLIN, timeout) <= 0)
+				break;
+		}
+	}
+	if (n == 0 && type == SOCK_DGRAM) {
+		lua_pushliteral(L, "");
+		return 1;
+	}
+	if (n <= 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+	if (n > max) {
+		luaL_pushresultsize(&b, max);
+		lua_pushinteger(L, n);
+		return 2;
+	}
+	luaL_pushresultsize(&b, n);
+	return 1;
+}
+
+/* Release the string or buffer pinned by zerocopy send id */
+static void
+zc_unpin(lua_State *L, int pins, struct socket *s, unsigned int id)
+{
+	struct buffer *b;
+
+	switch (lua_rawgeti(L, pins, id)) {
+	case LUA_TNIL:
+		break;
+	case LUA_TUSERDATA:
+		b = luaL_testudata(L, -1, BUFFER_METATABLE);
+		if (b != NULL)
+			b->pins--;
+		/* FALLTHROUGH */
+	default:
+		s->zcpending--;
+		lua_pushnil(L);
+		lua_rawseti(L, pins, id);
+	}
+	lua_pop(L, 1);
+}
+
+/*
+ * Drop all pins of the closed socket s at stack index idx.  Data still
+ * queued in the kernel may then change before it is transmitted, close
+ * after reapzc() reported all sends as completed to avoid that.
+ */
+static void
+zc_unpinall(lua_State *L, int idx, struct socket *s)
+{
+	struct buffer *b;
+
+	idx = lua_absindex(L, idx);
+	if (lua_getiuservalue(L, idx, 1) == LUA_TTABLE) {
+		lua_pushnil(L);
+		while (lua_next(L, -2)) {
+			b = luaL_testudata(L, -1, BUFFER_METATABLE);
+			if (b != NULL)
+				b->pins--;
+			lua_pop(L, 1);
+		}
+		lua_pushnil(L);
+		lua_setiuservalue(L, idx, 1);
+	}
+	lua_pop(L, 1);
+	s->zcpending = 0;
+}
+
+/*
+ * Read the completion notifications of zerocopy sends from the error
+ * queue and unpin their data.  Returns the number of completed sends,
+ * copied counts those the kernel had to copy nevertheless.
+ */
+static int
+zc_reap(lua_State *L, int pins, struct socket *s, int *copied)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err *ee;
+	union {
+		char	buf[CMSG_SPACE(sizeof(struct sock_extended_err))];
+		struct cmsghdr align;
+	} control;
+	unsigned int id;
+	int done = 0;
+
+	while (s->zcpending > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if (recvmsg(s->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == SOL_IP
+			    && cmsg->cmsg_type == IP_RECVERR)
+			    && !(cmsg->cmsg_level == SOL_IPV6
+			    && cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+			ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (ee->ee_errno != 0
+			    || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			/* ee_info to ee_data is the range of completed ids */
+			for (id = ee->ee_info; ; id++) {
+				zc_unpin(L, pins, s, id);
+				done++;
+				if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+					(*copied)++;
+				if (id == ee->ee_data)
+					break;
+			}
+		}
+	}
+	return done;
+}
+
+/* Push the table of pinned data, create it if create is set */
+static int
+zc_pins(lua_State *L, int create)
+{
+	if (lua_getiuservalue(L, 1, 1) != LUA_TTABLE && create) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setiuservalue(L, 1, 1);
+	}
+	return lua_gettop(L);
+}
+
+/*
+ * Send a string or the contents of a linux.buffer with MSG_ZEROCOPY, i.e.
+ * the kernel transmits directly from the memory of the string or buffer
+ * instead of copying it.  The data is pinned until reapzc() reports that
+ * the send completed; a pinned buffer can not be modified or closed.
+ * SO_ZEROCOPY is enabled on first use.  Remainders shorter than
+ * NET_ZCMIN bytes are sent normally, pinning does not pay off for them.
+ * Returns the number of bytes sent or nil, an error message and the
+ * number of bytes sent before the error.
+ */
+static int
+luanet_sendzc(lua_State *L)
+{
+	struct socket *s;
+	struct buffer *b;
+	const char *data;
+	size_t len, sent;
+	ssize_t n;
+	int pins, on, copied;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	if ((b = luaL_testudata(L, 2, BUFFER_METATABLE)) != NULL) {
+		if (b->data == NULL)
+			return luaL_argerror(L, 2, "closed buffer");
+		data = b->data;
+		len = b->len;
+	} else
+		data = luaL_checklstring(L, 2, &len);
+	lua_settop(L, 2);
+
+	if (!s->zerocopy) {
+		on = 1;
+		if (setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, &on,
+		    sizeof(on))) {
+			lua_pushnil(L);
+			lua_pushstring(L, strerror(errno));
+			lua_pushinteger(L, 0);
+			return 3;
+		}
+		s->zerocopy = 1;
+	}
+	pins = zc_pins(L, 1);
+
+	n = 0;
+	while (s->wdone < len) {
+		if (sock_deadline(s, 1)) {
+			n = -1;
+			break;
+		}
+		if (len - s->wdone < NET_ZCMIN)
+			n = send(s->fd, data + s->wdone, len - s->wdone,
+			    MSG_NOSIGNAL);
+		else {
+			n = send(s->fd, data + s->wdone, len - s->wdone,
+			    MSG_ZEROCOPY | MSG_NOSIGNAL);
+
+			/* every successful call is completed separately */
+			if (n >= 0) {
+				lua_pushvalue(L, 2);
+				lua_rawseti(L, pins, s->zcnext++);
+				if (b != NULL)
+					b->pins++;
+				s->zcpending++;
+			}
+		}
+		sock_account(s, 1, n);
+		if (n >= 0) {
+			s->wdone += n;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN) {
+			if (sched_active(L))
+				return sched_block(L, s->fd, POLLOUT,
+				    sock_timeout(s, -1), luanet_sendzc);
+			if (sock_poll(s, POLLOUT, -1) > 0)
+				continue;
+		}
+
+		/* too many notifications outstanding */
+		if (errno == ENOBUFS) {
+			copied = 0;
+			if (zc_reap(L, pins, s, &copied) > 0)
+				continue;
+			errno = ENOBUFS;
+		}
+		break;
+	}
+	sent = s->wdone;
+	s->wdone = 0;
+	if (n == -1) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		lua_pushinteger(L, sent);
+		return 3;
+	}
+	lua_pushinteger(L, sent);
+	return 1;
+}
+
+/*
+ * Reap the completions of zerocopy sends without blocking.  Returns the
+ * number of sends that completed, how many of those were copied by the
+ * kernel after all, e.g. on loopback, and the number still in flight.
+ */
+static int
+luanet_reapzc(lua_State *L)
+{
+	struct socket *s;
+	int pins, done, copied;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	lua_settop(L, 1);
+	pins = zc_pins(L, 0);
+
+	copied = 0;
+	done = lua_istable(L, pins) ? zc_reap(L, pins, s, &copied) : 0;
+	lua_pushinteger(L, done);
+	lua_pushinteger(L, copied);
+	lua_pushinteger(L, s->zcpending);
+	return 3;
+}
+
+/*
+ * Receive up to n datagrams with a single recvmmsg() call.  Returns an
+ * array of tables with the payload in data and the peer address in host
+ * and port.  Data buffered by read() and friends is left alone.
+ */
+static int
+luanet_recvmany(lua_State *L)
+{
+	struct socket *s;
+	struct mmsghdr msgs[NET_MAXMSGS];
+	struct iovec iov[NET_MAXMSGS];
+	struct sockaddr_storage addr[NET_MAXMSGS];
+	lua_Integer count, len;
+	size_t size;
+	ssize_t bytes;
+	char *buf;
+	int n, nmsgs, nrecv, timeout;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	count = luaL_optinteger(L, 2, NET_MAXMSGS);
+	timeout = luaL_optinteger(L, 3, -1);
+	len = luaL_optinteger(L, 4, NET_DGRAMSIZ);
+	luaL_argcheck(L, count > 0, 2, "number of messages must be positive");
+	luaL_argcheck(L, len > 0 && len <= NET_MAXDGRAM, 4,
+	    "invalid message size");
+	nmsgs = count > NET_MAXMSGS ? NET_MAXMSGS : count;
+	size = len;
+	if (size > SIZE_MAX / nmsgs)
+		return luaL_error(L, "memory error");
+
+	/* scratch receive area, collected with the userdata */
+	buf = lua_newuserdatauv(L, nmsgs * size, 0);
+
+	memset(msgs, 0, nmsgs * sizeof(struct mmsghdr));
+	for (n = 0; n < nmsgs; n++) {
+		iov[n].iov_base = buf + n * size;
+		iov[n].iov_len = size;
+		msgs[n].msg_hdr.msg_iov = &iov[n];
+		msgs[n].msg_hdr.msg_iovlen = 1;
+		msgs[n].msg_hdr.msg_name = &addr[n];
+		msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+	}
+
+	if (sock_deadline(s, 0)
+	    || (timeout >= 0 && sock_poll(s, POLLIN, timeout) <= 0)) {
+		lua_pushnil(L);
+		return 1;
+	}
+	do {
+		nrecv = recvmmsg(s->fd, msgs, nmsgs, MSG_WAITFORONE, NULL);
+		if (nrecv == -1)
+			sock_account(s, 0, -1);
+	} while (nrecv == -1 && errno == EINTR);
+	if (nrecv == -1) {
+		lua_pushnil(L);
+		return 1;
+	}
+	for (n = 0, bytes = 0; n < nrecv; n++)
+		bytes += msgs[n].msg_len;
+	sock_account(s, 0, bytes);
+
+	lua_createtable(L, nrecv, 0);
+	for (n = 0; n < nrecv; n++) {
+		luanet_pushaddr(L, (struct sockaddr *)&addr[n],
+		    msgs[n].msg_hdr.msg_namelen);
+		lua_pushlstring(L, iov[n].iov_base, msgs[n].msg_len);
+		lua_setfield(L, -2, "data");
+		lua_rawseti(L, -2, n + 1);
+	}
+	return 1;
+}
+
+/*
+ * Send an array of datagrams with sendmmsg().  Each element is either a
+ * string, for connected sockets, or a table with data, host and port as
+ * returned by recvmany().  Returns the number of datagrams sent.
+ */
+static int
+luanet_sendmany(lua_State *L)
+{
+	struct mmsghdr msgs[NET_MAXMSGS];
+	struct iovec iov[NET_MAXMSGS];
+	struct sockaddr_storage addr[NET_MAXMSGS];
+	socklen_t len;
+	struct socket *s;
+	lua_Integer nmsgs, first, total;
+	ssize_t bytes;
+	int fd, family, n, i, cnt, nsent;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	fd = s->fd;
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	len = sizeof(family);
+	if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &family, &len))
+		return luaL_error(L, "not a socket");
+
+	nmsgs = lua_rawlen(L, 2);
+	total = 0;
+	for (first = 1; first <= nmsgs; first += cnt) {
+		memset(msgs, 0, sizeof(msgs));
+		for (cnt = 0; first + cnt <= nmsgs && cnt < NET_MAXMSGS;
+		    cnt++) {
+			msgs[cnt].msg_hdr.msg_iov = &iov[cnt];
+			msgs[cnt].msg_hdr.msg_iovlen = 1;
+
+			/* the strings are kept alive by the table */
+			switch (lua_rawgeti(L, 2, first + cnt)) {
+			case LUA_TSTRING:
+				iov[cnt].iov_base = (void *)lua_tolstring(L,
+				    -1, &iov[cnt].iov_len);
+				break;
+			case LUA_TTABLE:
+				if (lua_getfield(L, -1, "data") != LUA_TSTRING)
+					return luaL_error(L, "sendmany: "
+					    "no data in element %d",
+					    (int)(first + cnt));
+				iov[cnt].iov_base = (void *)lua_tolstring(L,
+				    -1, &iov[cnt].iov_len);
+				lua_pop(L, 1);
+
+				lua_getfield(L, -1, "host");
+				lua_getfield(L, -2, "port");
+				if (!lua_isstring(L, -2) || sock_parseaddr(family,
+				    lua_tostring(L, -2), lua_tointeger(L, -1),
+				    &addr[cnt], &len))
+					return luaL_error(L, "sendmany: invalid "
+					    "address in element %d",
+					    (int)(first + cnt));
+				lua_pop(L, 2);
+				msgs[cnt].msg_hdr.msg_name = &addr[cnt];
+				msgs[cnt].msg_hdr.msg_namelen = len;
+				break;
+			default:
+				return luaL_error(L, "sendmany: element %d is "
+				    "neither a string nor a table",
+				    (int)(first + cnt));
+			}
+			lua_pop(L, 1);
+		}
+
+		for (n = 0; n < cnt; n += nsent) {
+			if (sock_deadline(s, 1)) {
+				lua_pushinteger(L, total + n);
+				return 1;
+			}
+			nsent = sendmmsg(fd, &msgs[n], cnt - n, 0);
+			if (nsent == -1) {
+				sock_account(s, 1, -1);
+				if (errno == EINTR || (errno == EAGAIN &&
+				    sock_poll(s, POLLOUT, -1) > 0)) {
+					nsent = 0;
+					continue;
+				}
+				lua_pushinteger(L, total + n);
+				return 1;
+			}
+			for (i = n, bytes = 0; i < n + nsent; i++)
+				bytes += msgs[i].msg_len;
+			sock_account(s, 1, bytes);
+		}
+		total += cnt;
+	}
+	lua_pushinteger(L, total);
+	return 1;
+}
+
+/*
+ * Send (part of) a file without copying it through userspace.  The file
+ * can be given as a descriptor, a Lua file handle or a path name.  Pipes
+ * are spliced, everything else is sent with sendfile().  Returns the
+ * number of bytes sent, which is short on non-blocking sockets when the
+ * socket buffer is full; call again with the offset advanced to resume.
+ */
+static int
+luanet_sendfile(lua_State *L)
+{
+	struct stat sb;
+	luaL_Stream *stream;
+	off_t offset;
+	size_t len, total;
+	struct socket *s;
+	ssize_t n;
+	int fd, infd, pathfd, error;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	fd = s->fd;
+	offset = luaL_optinteger(L, 3, 0);
+	pathfd = -1;
+
+	if (lua_isinteger(L, 2))
+		infd = lua_tointeger(L, 2);
+	else if ((stream = luaL_testudata(L, 2, LUA_FILEHANDLE)) != NULL) {
+		if (stream->closef == NULL)
+			return luaL_error(L, "attempt to use a closed file");
+		infd = fileno(stream->f);
+	} else {
+		infd = pathfd = open(luaL_checkstring(L, 2),
+		    O_RDONLY | O_CLOEXEC);
+		if (infd == -1)
+			goto failed;
+	}
+
+	if (fstat(infd, &sb))
+		goto failed;
+
+	if (!lua_isnoneornil(L, 4))
+		len = luaL_checkinteger(L, 4);
+	else if (S_ISREG(sb.st_mode))
+		len = sb.st_size > offset ? sb.st_size - offset : 0;
+	else
+		len = SIZE_MAX;
+
+	for (total = 0; total < len; total += n) {
+		if (sock_deadline(s, 1)) {
+			if (total > 0)
+				break;
+			goto failed;
+		}
+		if (S_ISFIFO(sb.st_mode))
+			n = splice(infd, NULL, fd, NULL, len - total,
+			    SPLICE_F_MOVE | SPLICE_F_MORE);
+		else
+			n = sendfile(fd, infd, &offset, len - total);
+		sock_account(s, 1, n);
+		if (n == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			if (errno == EAGAIN || total > 0)
+				break;
+			goto failed;
+		}
+		if (n == 0)
+			break;
+	}
+
+	if (pathfd != -1)
+		close(pathfd);
+	lua_pushinteger(L, total);
+	return 1;
+
+failed:
+	error = errno;
+	if (pathfd != -1)
+		close(pathfd);
+	lua_pushnil(L);
+	lua_pushstring(L, strerror(error));
+	return 2;
+}
+
+/*
+ * Return the descriptor of a socket, a Lua file handle or an integer at
+ * stack index n, or -1 if the value is neither.
+ */
+static int
+sock_tofd(lua_State *L, int n)
+{
+	luaL_Stream *stream;
+	int *fd;
+
+	if (lua_isinteger(L, n))
+		return lua_tointeger(L, n);
+	if ((fd = luaL_testudata(L, n, SOCKET_METATABLE)) != NULL)
+		return *fd;
+	if ((stream = luaL_testudata(L, n, LUA_FILEHANDLE)) != NULL
+	    && stream->closef != NULL)
+		return fileno(stream->f);
+	return -1;
+}
+
+/*
+ * Send the descriptors fds with the payload over a unix domain socket in
+ * a single message.  The payload can not be empty, one byte is sent if it
+ * is missing.
+ */
+static ssize_t
+sock_sendfds(int fd, int *fds, int nfds, const char *payload, size_t len)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov[1];
+	union {
+		struct cmsghdr	hdr;
+		unsigned char	buf[CMSG_SPACE(NET_MAXFDS * sizeof(int))];
+	} control;
+	char nul = 0;
+
+	if (len == 0) {
+		payload = &nul;
+		len = 1;
+	}
+	iov[0].iov_base = (void *)payload;
+	iov[0].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+
+	if (nfds > 0) {
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+	return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+static int
+luanet_sendfd(lua_State *L)
+{
+	int fd, passfd;
+
+	fd = *(int *)luaL_checkudata(L, 1, SOCKET_METATABLE);
+	passfd = sock_tofd(L, 2);
+	if (passfd == -1)
+		return luaL_argerror(L, 2, "socket or file descriptor "
+		    "expected");
+
+	if (sock_sendfds(fd, &passfd, 1, NULL, 0) == -1)
+		return luaL_error(L, "sendmsg failed");
+	return 0;
+}
+
+/*
+ * Pass all descriptors in the array fds, sockets, Lua files or integers,
+ * and an optional payload in one message.  Returns the number of payload
+ * bytes sent.
+ */
+static int
+luanet_sendfds(lua_State *L)
+{
+	struct socket *s;
+	int fds[NET_MAXFDS];
+	const char *payload;
+	size_t len;
+	ssize_t n;
+	int fd, nfds, i;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	fd = s->fd;
+	luaL_checktype(L, 2, LUA_TTABLE);
+	payload = luaL_optlstring(L, 3, NULL, &len);
+	if (payload == NULL)
+		len = 0;
+
+	nfds = lua_rawlen(L, 2);
+	luaL_argcheck(L, nfds <= NET_MAXFDS, 2, "too many descriptors");
+	for (i = 0; i < nfds; i++) {
+		lua_rawgeti(L, 2, i + 1);
+		fds[i] = sock_tofd(L, -1);
+		lua_pop(L, 1);
+		if (fds[i] == -1)
+			return luaL_error(L, "descriptor %d is not a socket, "
+			    "file or integer", i + 1);
+	}
+
+	n = sock_deadline(s, 1) ? -1 :
+	    sock_sendfds(fd, fds, nfds, payload, len);
+	if (n == -1) {
+		if (errno == EAGAIN && sched_active(L))
+			return sched_block(L, fd, POLLOUT, sock_timeout(s, -1),
+			    luanet_sendfds);
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	lua_pushinteger(L, payload == NULL ? 0 : n);
+	return 1;
+}
+
+/* Wrap a descriptor passed by another process, keeping its O_NONBLOCK flag */
+static struct socket *
+sock_pushfd(lua_State *L, int fd)
+{
+	struct socket *s;
+	int flags;
+
+	s = luanet_pushsocket(L, fd);
+	flags = fcntl(fd, F_GETFL);
+	s->nonblock = flags != -1 && (flags & O_NONBLOCK);
+	return s;
+}
+
+/*
+ * Receive a message with up to max descriptors, which are stored in fds
+ * with close-on-exec set.  Returns the length of the payload, which is
+ * read into buf, or -1 with errno set.  Descriptors beyond max are closed
+ * by the kernel.
+ */
+static ssize_t
+sock_recvfds(int fd, int *fds, int max, int *nfds, char *buf, size_t size)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov[1];
+	union {
+		struct cmsghdr	hdr;
+		unsigned char	buf[CMSG_SPACE(NET_MAXFDS * sizeof(int))];
+	} control;
+	ssize_t len;
+	int i, n;
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = size;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(max * sizeof(int));
+
+	*nfds = 0;
+	len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (len == -1)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET
+		    || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < n && *nfds < max; i++)
+			fds[(*nfds)++] = ((int *)CMSG_DATA(cmsg))[i];
+	}
+	return len;
+}
+
+/*
+ * Receive a message with up to max descriptors.  Returns an array of
+ * sockets, which keep their O_NONBLOCK flag, and the payload, or nil when the peer has closed the
+ * connection.  Descriptors beyond max are closed by the kernel.
+ */
+static int
+luanet_recvfds(lua_State *L)
+{
+	struct socket *s;
+	int fds[NET_MAXFDS];
+	luaL_Buffer b;
+	char *buf;
+	size_t size;
+	ssize_t len;
+	int fd, max, i, nfds;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	fd = s->fd;
+	max = luaL_optinteger(L, 2, NET_MAXFDS);
+	size = luaL_optinteger(L, 3, NET_DGRAMSIZ);
+	luaL_argcheck(L, max > 0 && max <= NET_MAXFDS, 2,
+	    "invalid number of descriptors");
+
+	buf = luaL_buffinitsize(L, &b, size);
+	len = sock_deadline(s, 0) ? -1 :
+	    sock_recvfds(fd, fds, max, &nfds, buf, size);
+	if (len == -1) {
+		if (errno == EAGAIN && sched_active(L)) {
+			lua_settop(L, 3);
+			return sched_block(L, fd, POLLIN, sock_timeout(s, -1),
+			    luanet_recvfds);
+		}
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	luaL_pushresultsize(&b, len);
+
+	lua_createtable(L, nfds, 0);
+	for (i = 0; i < nfds; i++) {
+		sock_pushfd(L, fds[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	if (len == 0 && nfds == 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_insert(L, -2);
+	return 2;
+}
+
+/*
+ * Push an array of sockets for the listening descriptors fds and an array
+ * with their names, taken from the colon separated list names, which may
+ * be NULL or have fewer entries.  Descriptors keep their O_NONBLOCK flag.
+ */
+static void
+sock_pushlisteners(lua_State *L, int *fds, int nfds, const char *names)
+{
+	const char *p;
+	int i;
+
+	lua_createtable(L, nfds, 0);
+	lua_createtable(L, nfds, 0);
+	for (i = 0; i < nfds; i++) {
+		sock_pushfd(L, fds[i]);
+		lua_rawseti(L, -3, i + 1);
+
+		if (names != NULL && *names != '\0') {
+			p = strchrnul(names, ':');
+			lua_pushlstring(L, names, p - names);
+			names = *p == ':' ? p + 1 : p;
+		} else
+			lua_pushliteral(L, "unknown");
+		lua_rawseti(L, -2, i + 1);
+	}
+}
+
+/*
+ * Return the listening sockets passed by systemd socket activation as an
+ * array, and an array with their names from FileDescriptorName=.  Both
+ * are empty if the descriptors were not meant for this process, i.e. if
+ * LISTEN_PID is not our pid.  LISTEN_PID, LISTEN_FDS and LISTEN_FDNAMES
+ * are then removed from the environment, so that neither a second call
+ * nor a child wraps the same descriptors again.
+ */
+static int
+luanet_inherited(lua_State *L)
+{
+	int fds[NET_MAXFDS];
+	const char *pid, *nfds, *names;
+	int i, n;
+
+	pid = getenv("LISTEN_PID");
+	nfds = getenv("LISTEN_FDS");
+	names = getenv("LISTEN_FDNAMES");
+	n = 0;
+	if (pid == NULL || nfds == NULL || atol(pid) != getpid())
+		pid = NULL;
+	else {
+		n = atoi(nfds);
+		if (n < 0)
+			n = 0;
+		else if (n > NET_MAXFDS)
+			n = NET_MAXFDS;
+	}
+
+	for (i = 0; i < n; i++) {
+		fds[i] = NET_LISTENFDS + i;
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	sock_pushlisteners(L, fds, n, names);
+
+	if (pid != NULL) {
+		unsetenv("LISTEN_PID");
+		unsetenv("LISTEN_FDS");
+		unsetenv("LISTEN_FDNAMES");
+	}
+	return 2;
+}
+
+/*
+ * Hand the listening sockets in the array listeners over to the process
+ * at the other end of a unix domain socket, e.g. a newly started instance
+ * that calls takeover().  The optional array names is sent along as with
+ * LISTEN_FDNAMES.  The sockets stay open in this process, so both can
+ * accept connections until the old instance closes its listeners and
+ * drains its connections; no connection is refused in between.
+ */
+static int
+luanet_handoff(lua_State *L)
+{
+	int fds[NET_MAXFDS];
+	luaL_Buffer b;
+	const char *name;
+	ssize_t n;
+	int fd, nfds, i;
+
+	fd = *(int *)luaL_checkudata(L, 1, SOCKET_METATABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	if (!lua_isnoneornil(L, 3))
+		luaL_checktype(L, 3, LUA_TTABLE);
+
+	nfds = lua_rawlen(L, 2);
+	luaL_argcheck(L, nfds <= NET_MAXFDS, 2, "too many descriptors");
+
+	luaL_buffinit(L, &b);
+	for (i = 0; i < nfds; i++) {
+		lua_rawgeti(L, 2, i + 1);
+		fds[i] = sock_tofd(L, -1);
+		lua_pop(L, 1);
+		if (fds[i] == -1)
+			return luaL_error(L, "listener %d is not a socket or "
+			    "descriptor", i + 1);
+
+		/* the string stays referenced by the names table */
+		name = "unknown";
+		if (lua_istable(L, 3)) {
+			if (lua_rawgeti(L, 3, i + 1) == LUA_TSTRING)
+				name = lua_tostring(L, -1);
+			lua_pop(L, 1);
+		}
+		if (*name == '\0' || strchr(name, ':') != NULL)
+			return luaL_error(L, "invalid name for listener %d",
+			    i + 1);
+		if (i > 0)
+			luaL_addchar(&b, ':');
+		luaL_addstring(&b, name);
+	}
+	luaL_pushresult(&b);
+
+	n = sock_sendfds(fd, fds, nfds, lua_tostring(L, -1),
+	    lua_rawlen(L, -1));
+	if (n == -1) {
+		if (errno == EAGAIN && sched_active(L)) {
+			lua_settop(L, 3);
+			return sched_block(L, fd, POLLOUT, -1, luanet_handoff);
+		}
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Receive the listening sockets sent with handoff().  Returns an array of
+ * sockets and an array of their names like inherited(), or nil and an
+ * error message.
+ */
+static int
+luanet_takeover(lua_State *L)
+{
+	int fds[NET_MAXFDS];
+	luaL_Buffer b;
+	char *buf;
+	ssize_t len;
+	int fd, nfds;
+
+	fd = *(int *)luaL_checkudata(L, 1, SOCKET_METATABLE);
+
+	buf = luaL_buffinitsize(L, &b, NET_BUFSIZ);
+	len = sock_recvfds(fd, fds, NET_MAXFDS, &nfds, buf, NET_BUFSIZ - 1);
+	if (len == -1) {
+		if (errno == EAGAIN && sched_active(L)) {
+			lua_settop(L, 1);
+			return sched_block(L, fd, POLLIN, -1, luanet_takeover);
+		}
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	if (len == 0 && nfds == 0) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "connection closed");
+		return 2;
+	}
+	buf[len] = '\0';
+	sock_pushlisteners(L, fds, nfds, buf);
+	return 2;
+}
+
+static int
+luanet_recvfd(lua_State *L)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov[1];
+	unsigned char fdbuf[CMSG_SPACE(sizeof(int))];
+	char buf[16];
+	int fd;
+
+	fd = *(int *)luaL_checkudata(L, 1, SOCKET_METATABLE);
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = sizeof(buf);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+
+	msg.msg_control = fdbuf;
+	msg.msg_controllen = CMSG_LEN(sizeof(int));
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+
+	if (recvmsg(fd, &msg, 0) < 0)
+		return luaL_error(L, "recvmsg failed");
+	luanet_pushsocket(L, *(int *)CMSG_DATA(cmsg));
+	return 1;
+}
+
+static int
+luanet_isvalid(lua_State *L)
+{
+	int error;
+	socklen_t len = sizeof(error);
+
+	lua_pushboolean(L,
+	    getsockopt(*(int *)luaL_checkudata(L, 1, SOCKET_METATABLE),
+	    SOL_SOCKET, SO_ERROR, &error, &len) == 0 ? 1 : 0);
+
+	return 1;
+}
+
+/* Close the socket at stack index idx and release what it holds */
+static void
+sock_close(lua_State *L, int idx)
+{
+	struct socket *s;
+
+	s = lua_touserdata(L, idx);
+	if (s->fd >= 0) {
+		close(s->fd);
+		s->fd = -1;
+	}
+	free(s->rbuf);
+	s->rbuf = NULL;
+	s->rsize = s->rpos = s->rend = 0;
+	free(s->stats);
+	s->stats = NULL;
+	zc_unpinall(L, idx, s);
+}
+
+static int
+luanet_close(lua_State *L)
+{
+	luaL_checkudata(L, 1, SOCKET_METATABLE);
+	sock_close(L, 1);
+	return 0;
+}
+
+/*
+ * Set a deadline ms milliseconds from now for all further reads and
+ * writes, across calls.  Once it has passed they fail, also if data is
+ * ready, so a peer trickling data can not hold a worker.  Per-call
+ * timeouts still apply but can not extend it.  Without an argument the
+ * deadline is removed.  Returns the milliseconds that were left of the
+ * previous deadline or nil.
+ */
+static int
+luanet_deadline(lua_State *L)
+{
+	struct socket *s;
+	lua_Integer ms;
+	long long left;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	ms = luaL_optinteger(L, 2, -1);
+
+	if (s->deadline != 0) {
+		left = s->deadline - sock_now();
+		lua_pushinteger(L, left > 0 ? left : 0);
+	} else
+		lua_pushnil(L);
+
+	sock_nodeadline(s);
+	if (ms >= 0)
+		s->deadline = sock_now() + ms;
+	return 1;
+}
+
+/* Put a socket into non-blocking mode, required for use with a scheduler */
+static int
+luanet_setnonblock(lua_State *L)
+{
+	struct socket *s;
+	int flags, on;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	on = lua_isnoneornil(L, 2) ? 1 : lua_toboolean(L, 2);
+
+	flags = fcntl(s->fd, F_GETFL);
+	if (flags == -1 || fcntl(s->fd, F_SETFL,
+	    on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) == -1) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	s->nonblock = on;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int
+luanet_setopt(lua_State *L)
+{
+	const struct sockopt *o;
+	int *fd, val;
+
+	fd = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	o = sock_findopt(L, 2);
+	if (o->boolean || lua_isboolean(L, 3))
+		val = lua_toboolean(L, 3);
+	else
+		val = luaL_checkinteger(L, 3);
+
+	if (setsockopt(*fd, o->level, o->optname, &val, sizeof(val))) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int
+luanet_getopt(lua_State *L)
+{
+	const struct sockopt *o;
+	socklen_t len;
+	int *fd, val;
+
+	fd = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	o = sock_findopt(L, 2);
+
+	len = sizeof(val);
+	if (getsockopt(*fd, o->level, o->optname, &val, &len)) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+	if (o->boolean)
+		lua_pushboolean(L, val);
+	else
+		lua_pushinteger(L, val);
+	return 1;
+}
+
+/* Enable or disable the I/O counters, enabling resets them */
+static int
+luanet_setstats(lua_State *L)
+{
+	struct socket *s;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	free(s->stats);
+	s->stats = NULL;
+	if (lua_isnoneornil(L, 2) || lua_toboolean(L, 2)) {
+		s->stats = calloc(1, sizeof(struct sockstats));
+		if (s->stats == NULL)
+			return luaL_error(L, "memory error");
+	}
+	return 0;
+}
+
+#define TCPI_FIELD(name, field) \
+	do { \
+		lua_pushinteger(L, ti.field); \
+		lua_setfield(L, -2, name); \
+	} while (0)
+
+/*
+ * Return a table with the I/O counters, if enabled, and for TCP sockets
+ * the connection state from TCP_INFO.  Times are in microseconds.
+ */
+static int
+luanet_stats(lua_State *L)
+{
+	struct socket *s;
+	struct sockstats *st;
+	struct tcp_info ti;
+	socklen_t len;
+
+	s = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	lua_newtable(L);
+
+	if ((st = s->stats) != NULL) {
+		lua_pushinteger(L, st->rbytes);
+		lua_setfield(L, -2, "bytes_in");
+		lua_pushinteger(L, st->wbytes);
+		lua_setfield(L, -2, "bytes_out");
+		lua_pushinteger(L, st->reads);
+		lua_setfield(L, -2, "reads");
+		lua_pushinteger(L, st->writes);
+		lua_setfield(L, -2, "writes");
+		lua_pushinteger(L, st->eagain);
+		lua_setfield(L, -2, "eagain");
+		lua_pushinteger(L, st->polls);
+		lua_setfield(L, -2, "polls");
+		lua_pushinteger(L, st->polltime);
+		lua_setfield(L, -2, "poll_time");
+	}
+
+	memset(&ti, 0, sizeof(ti));
+	len = sizeof(ti);
+	if (getsockopt(s->fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0) {
+		TCPI_FIELD("state", tcpi_state);
+		TCPI_FIELD("ca_state", tcpi_ca_state);
+		TCPI_FIELD("rtt", tcpi_rtt);
+		TCPI_FIELD("rttvar", tcpi_rttvar);
+		TCPI_FIELD("rto", tcpi_rto);
+		TCPI_FIELD("snd_cwnd", tcpi_snd_cwnd);
+		TCPI_FIELD("snd_ssthresh", tcpi_snd_ssthresh);
+		TCPI_FIELD("snd_mss", tcpi_snd_mss);
+		TCPI_FIELD("rcv_mss", tcpi_rcv_mss);
+		TCPI_FIELD("rcv_space", tcpi_rcv_space);
+		TCPI_FIELD("pmtu", tcpi_pmtu);
+		TCPI_FIELD("unacked", tcpi_unacked);
+		TCPI_FIELD("sacked", tcpi_sacked);
+		TCPI_FIELD("lost", tcpi_lost);
+		TCPI_FIELD("retrans", tcpi_retrans);
+		TCPI_FIELD("retransmits", tcpi_retransmits);
+		TCPI_FIELD("total_retrans", tcpi_total_retrans);
+		TCPI_FIELD("reordering", tcpi_reordering);
+		TCPI_FIELD("last_data_sent", tcpi_last_data_sent);
+		TCPI_FIELD("last_data_recv", tcpi_last_data_recv);
+	}
+	return 1;
+}
+
+/*
+ * Proxy
+ *
+ * Relay data between two sockets until both directions have reached end
+ * of file.  Each direction is spliced from its source socket into a pipe
+ * and from the pipe into its destination, so the data never leaves the
+ * kernel.
+ */
+
+/* Forward data the source socket had already buffered */
+static int
+relay_flush(struct relay *r)
+{
+	struct socket *s = r->src;
+	ssize_t n;
+
+	while (s->rpos < s->rend) {
+		n = write(r->dst->fd, s->rbuf + s->rpos, s->rend - s->rpos);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN
+			    && sock_poll(r->dst, POLLOUT, -1) > 0)
+				continue;
+			if (r->dst->deadline != 0 && errno == EAGAIN)
+				errno = ETIMEDOUT;
+			return -1;
+		}
+		s->rpos += n;
+		r->bytes += n;
+	}
+	return 0;
+}
+
+/* Move as much data as possible without blocking */
+static int
+relay_move(struct relay *r)
+{
+	ssize_t n;
+
+	while (!r->eof && r->inpipe < NET_SPLICESIZ) {
+		n = splice(r->src->fd, NULL, r->pipe[1], NULL,
+		    NET_SPLICESIZ - r->inpipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n == 0)
+			r->eof = 1;
+		else if (n > 0)
+			r->inpipe += n;
+		else if (errno == EAGAIN)
+			break;
+		else if (errno != EINTR)
+			return -1;
+	}
+
+	while (r->inpipe > 0) {
+		n = splice(r->pipe[0], NULL, r->dst->fd, NULL, r->inpipe,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			r->inpipe -= n;
+			r->bytes += n;
+		} else if (n == -1 && errno == EAGAIN)
+			break;
+		else if (n == -1 && errno != EINTR)
+			return -1;
+	}
+
+	if (r->eof && r->inpipe == 0 && !r->shut) {
+		shutdown(r->dst->fd, SHUT_WR);
+		r->shut = 1;
+	}
+	return 0;
+}
+
+/*
+ * Relay between sockets a and b.  Returns the number of bytes sent from a
+ * to b and from b to a, followed by nil when both sides have closed or
+ * by "timeout" or an error message.  The option idle_timeout limits the
+ * time without any traffic in milliseconds.  Once the deadline of either
+ * socket has passed, the proxy ends with ETIMEDOUT.  Blocks the calling
+ * thread, also inside a scheduler coroutine.
+ */
+static int
+luanet_proxy(lua_State *L)
+{
+	struct relay r[2];
+	struct pollfd pfd[2];
+	struct timespec zero = { 0, 0 };
+	sigset_t pipeset, oldset, pending;
+	const char *error = NULL;
+	socklen_t len;
+	int flags[2], i, n, timeout, err;
+
+	memset(r, 0, sizeof(r));
+	r[0].src = r[1].dst = luaL_checkudata(L, 1, SOCKET_METATABLE);
+	r[0].dst = r[1].src = luaL_checkudata(L, 2, SOCKET_METATABLE);
+	timeout = -1;
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "idle_timeout");
+		timeout = luaL_optinteger(L, -1, -1);
+		lua_pop(L, 1);
+	}
+
+	/* a peer that goes away must not kill us with SIGPIPE */
+	sigemptyset(&pipeset);
+	sigaddset(&pipeset, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipeset, &oldset);
+
+	r[0].pipe[0] = r[0].pipe[1] = r[1].pipe[0] = r[1].pipe[1] = -1;
+	if (pipe2(r[0].pipe, O_NONBLOCK | O_CLOEXEC)
+	    || pipe2(r[1].pipe, O_NONBLOCK | O_CLOEXEC)) {
+		error = strerror(errno);
+		goto done;
+	}
+
+	for (i = 0; i < 2; i++) {
+		flags[i] = fcntl(r[i].src->fd, F_GETFL);
+		if (flags[i] != -1 && !(flags[i] & O_NONBLOCK))
+			fcntl(r[i].src->fd, F_SETFL, flags[i] | O_NONBLOCK);
+	}
+
+	for (i = 0; i < 2; i++)
+		if (relay_flush(&r[i])) {
+			error = strerror(errno);
+			goto restore;
+		}
+
+	while (!r[0].shut || !r[1].shut) {
+		for (i = 0; i < 2; i++)
+			if (relay_move(&r[i])) {
+				error = strerror(errno);
+				goto restore;
+			}
+		if (r[0].shut && r[1].shut)
+			break;
+
+		/*
+		 * The source of r[i] is the destination of the other.  A
+		 * socket nothing is expected from is left out, poll() would
+		 * report POLLHUP for it over and over again.
+		 */
+		for (i = 0; i < 2; i++) {
+			pfd[i].events = 0;
+			if (!r[i].eof && r[i].inpipe < NET_SPLICESIZ)
+				pfd[i].events |= POLLIN;
+			if (r[!i].inpipe > 0)
+				pfd[i].events |= POLLOUT;
+			pfd[i].fd = pfd[i].events ? r[i].src->fd : -1;
+			pfd[i].revents = 0;
+		}
+		/* the deadlines of both sockets end the proxy as well */
+		n = poll(pfd, 2, sock_timeout(r[0].src,
+		    sock_timeout(r[1].src, timeout)));
+
+		/* poll() never times out while a peer keeps sending */
+		if (sock_expired(r[0].src) || sock_expired(r[1].src)) {
+			error = strerror(ETIMEDOUT);
+			break;
+		}
+		if (n == 0) {
+			error = "timeout";
+			break;
+		}
+		if (n == -1 && errno != EINTR) {
+			error = strerror(errno);
+			break;
+		}
+
+		for (i = 0; i < 2; i++) {
+			if (pfd[i].revents & (POLLERR | POLLNVAL)) {
+				len = sizeof(err);
+				if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR,
+				    &err, &len) || err == 0)
+					err = EPIPE;
+				error = strerror(err);
+				goto restore;
+			}
+
+			/* hung up while data for it is waiting in the pipe */
+			if ((pfd[i].revents & POLLHUP)
+			    && !(pfd[i].revents & POLLIN) && r[!i].inpipe > 0) {
+				error = strerror(EPIPE);
+				goto restore;
+			}
+		}
+	}
+
+restore:
+	for (i = 0; i < 2; i++)
+		if (flags[i] != -1 && !(flags[i] & O_NONBLOCK))
+			fcntl(r[i].src->fd, F_SETFL, flags[i]);
+done:
+	for (i = 0; i < 2; i++) {
+		if (r[i].pipe[0] != -1)
+			close(r[i].pipe[0]);
+		if (r[i].pipe[1] != -1)
+			close(r[i].pipe[1]);
+	}
+	if (!sigismember(&oldset, SIGPIPE)) {
+		sigpending(&pending);
+		if (sigismember(&pending, SIGPIPE))
+			sigtimedwait(&pipeset, NULL, &zero);
+		pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	}
+	lua_pushinteger(L, r[0].bytes);
+	lua_pushinteger(L, r[1].bytes);
+	if (error != NULL)
+		lua_pushstring(L, error);
+	else
+		lua_pushnil(L);
+	return 3;
+}
+
+/*
+ * Connection pool
+ *
+ * The first uservalue of a pool maps "host:port" to an array of idle
+ * sockets, the most recently returned last.  The second uservalue is a
+ * table with weak keys that maps every socket the pool connected to an
+ * array holding its key, the time of the connect and the time it was last
+ * returned to the pool.
+ */
+
+enum {
+	POOL_KEY = 1,
+	POOL_BORN,
+	POOL_SINCE
+};
+
+/*
+ * A pooled connection can be reused if the peer neither closed it nor sent
+ * anything while it was idle.
+ */
+static int
+sock_healthy(struct socket *s)
+{
+	socklen_t len;
+	int error;
+	char c;
+
+	if (s->fd == -1 || s->rend > s->rpos)
+		return 0;
+
+	len = sizeof(error);
+	if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &error, &len) || error)
+		return 0;
+
+	return recv(s->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1
+	    && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Check the limits of the socket on top of the stack, meta at index meta */
+static int
+pool_expired(lua_State *L, struct pool *p, int meta, long long now)
+{
+	long long t;
+
+	if (p->lifetime >= 0) {
+		lua_rawgeti(L, meta, POOL_BORN);
+		t = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if (now - t >= p->lifetime)
+			return 1;
+	}
+	if (p->idletime >= 0) {
+		lua_rawgeti(L, meta, POOL_SINCE);
+		t = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if (now - t >= p->idletime)
+			return 1;
+	}
+	return 0;
+}
+
+static int
+luanet_pool(lua_State *L)
+{
+	struct pool *p;
+
+	p = lua_newuserdatauv(L, sizeof(struct pool), 2);
+	p->maxidle = NET_POOLIDLE;
+	p->lifetime = p->idletime = -1;
+	p->hits = p->misses = p->evicted = 0;
+
+	if (lua_istable(L, 1)) {
+		lua_getfield(L, 1, "max_idle");
+		p->maxidle = luaL_optinteger(L, -1, NET_POOLIDLE);
+		lua_getfield(L, 1, "max_lifetime");
+		p->lifetime = luaL_optinteger(L, -1, -1);
+		lua_getfield(L, 1, "idle_timeout");
+		p->idletime = luaL_optinteger(L, -1, -1);
+		lua_pop(L, 3);
+	}
+
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 1);
+
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushliteral(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_setiuservalue(L, -2, 2);
+
+	luaL_setmetatable(L, POOL_METATABLE);
+	return 1;
+}
+
+/* The connect of a pool miss returned, record the new socket */
+static int
+pool_get_k(lua_State *L, int status, lua_KContext ctx)
+{
+	lua_getiuservalue(L, 1, 2);
+	lua_pushvalue(L, -2);
+	lua_createtable(L, 3, 0);
+	lua_pushvalue(L, ctx);
+	lua_rawseti(L, -2, POOL_KEY);
+	lua_pushinteger(L, sock_now());
+	lua_rawseti(L, -2, POOL_BORN);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	lua_pushboolean(L, 0);
+	return 2;
+}
+
+/*
+ * Return an idle connection to host and port that passes the health
+ * checks, or connect a new one.  The second return value tells whether the
+ * connection was reused.
+ */
+static int
+luanet_pool_get(lua_State *L)
+{
+	struct pool *p;
+	struct socket *s;
+	long long now;
+	lua_Integer n;
+	int key;
+
+	p = luaL_checkudata(L, 1, POOL_METATABLE);
+	luaL_checkstring(L, 2);
+	luaL_checkstring(L, 3);
+	lua_settop(L, 4);
+
+	lua_pushfstring(L, "%s:%s", lua_tostring(L, 2), lua_tostring(L, 3));
+	key = lua_gettop(L);
+
+	lua_getiuservalue(L, 1, 1);
+	lua_getiuservalue(L, 1, 2);
+	lua_pushvalue(L, key);
+	if (lua_rawget(L, key + 1) == LUA_TTABLE) {
+		now = sock_now();
+		for (n = lua_rawlen(L, key + 3); n > 0; n--) {
+			lua_rawgeti(L, key + 3, n);
+			lua_pushnil(L);
+			lua_rawseti(L, key + 3, n);
+			s = lua_touserdata(L, -1);
+
+			lua_pushvalue(L, -1);
+			lua_rawget(L, key + 2);
+			if (!pool_expired(L, p, lua_gettop(L), now)
+			    && sock_healthy(s)) {
+				lua_pop(L, 1);
+				p->hits++;
+				lua_pushboolean(L, 1);
+				return 2;
+			}
+			lua_pop(L, 1);
+			sock_close(L, -1);
+			lua_pop(L, 1);
+			p->evicted++;
+		}
+	}
+
+	p->misses++;
+	lua_settop(L, key);
+	lua_pushcfunction(L, luanet_connect);
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 3);
+	lua_pushvalue(L, 4);
+	lua_callk(L, 3, 1, key, pool_get_k);
+	return pool_get_k(L, LUA_OK, key);
+}
+
+/*
+ * Return a connection to the pool.  Connections over the limits of the
+ * pool or that fail the health checks are closed instead.  Returns true
+ * if the connection was kept.
+ */
+static int
+luanet_pool_put(lua_State *L)
+{
+	struct pool *p;
+	struct socket *s;
+	long long now;
+	lua_Integer n;
+
+	p = luaL_checkudata(L, 1, POOL_METATABLE);
+	s = luaL_checkudata(L, 2, SOCKET_METATABLE);
+	lua_settop(L, 2);
+
+	lua_getiuservalue(L, 1, 2);
+	lua_pushvalue(L, 2);
+	if (lua_rawget(L, 3) != LUA_TTABLE)
+		return luaL_argerror(L, 2, "socket does not belong to this "
+		    "pool");
+
+	now = sock_now();
+	lua_pushinteger(L, now);
+	lua_rawseti(L, 4, POOL_SINCE);
+
+	lua_getiuservalue(L, 1, 1);
+	lua_rawgeti(L, 4, POOL_KEY);
+	lua_pushvalue(L, 6);
+	if (lua_rawget(L, 5) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, 6);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, 5);
+	}
+
+	sock_nodeadline(s);
+	n = lua_rawlen(L, 7);
+	if (n >= p->maxidle || pool_expired(L, p, 4, now)
+	    || !sock_healthy(s)) {
+		sock_close(L, 2);
+		p->evicted++;
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, 7, n + 1);
+	lua_pushboolean(L, 1);
+	return 1;
+}
 
-		if (fd < 0)
-			return luaL_error(L, "connection error");
+static int
+luanet_pool_stats(lua_State *L)
+{
+	struct pool *p;
+	lua_Integer idle = 0;
 
-		if (listen(fd, lua_gettop(L) > 2 ? luaL_checkinteger(L, 3) : 32))
-			return luaL_error(L, "listen error");
+	p = luaL_checkudata(L, 1, POOL_METATABLE);
+
+	lua_getiuservalue(L, 1, 1);
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		idle += lua_rawlen(L, -1);
+		lua_pop(L, 1);
 	}
-	data = (int *)lua_newuserdata(L, sizeof(int *));
-	*data = fd;
-	luaL_getmetatable(L, SOCKET_METATABLE);
-	lua_setmetatable(L, -2);
+	lua_pop(L, 1);
 
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, p->hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, p->misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, p->evicted);
+	lua_setfield(L, -2, "evicted");
+	lua_pushinteger(L, idle);
+	lua_setfield(L, -2, "idle");
 	return 1;
 }
 
+/* Close all idle connections */
 static int
-luanet_connect(lua_State *L)
+luanet_pool_close(lua_State *L)
 {
-	struct addrinfo hints, *res, *res0;
-	struct sockaddr_un addr;
-	int fd, error, *data;
-	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-	const char *port, *host;
-
-	host = luaL_checkstring(L, 1);
-	if (*host == '/' || *host == '.') {
-		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	lua_Integer n;
 
-		if (fd >= 0) {
-			memset(&addr, 0, sizeof(struct sockaddr_un));
-			addr.sun_family = AF_UNIX;
-			strncpy(addr.sun_path, host, sizeof(addr.sun_path) - 1);
+	luaL_checkudata(L, 1, POOL_METATABLE);
 
-			if (connect(fd, (struct sockaddr *)&addr,
-			    sizeof(struct sockaddr_un)) == -1)
-				return luaL_error(L, "connect error");
+	lua_getiuservalue(L, 1, 1);
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		for (n = lua_rawlen(L, -1); n > 0; n--) {
+			lua_rawgeti(L, -1, n);
+			sock_close(L, -1);
+			lua_pop(L, 1);
 		}
-	} else {
-		port = luaL_checkstring(L, 2);
+		lua_pop(L, 1);
+	}
+	lua_newtable(L);
+	lua_setiuservalue(L, 1, 1);
+	return 0;
+}
 
-		memset(&hints, 0, sizeof(hints));
-		hints.ai_socktype = SOCK_STREAM;
-		error = getaddrinfo(host, port, &hints, &res0);
-		if (error)
-			return luaL_error(L, "%s: %s\n", host,
-			    gai_strerror(error));
-		fd = -1;
-		for (res = res0; res; res = res->ai_next) {
-			error = getnameinfo(res->ai_addr, res->ai_addrlen, hbuf,
-			    sizeof(hbuf), sbuf, sizeof(sbuf), NI_NUMERICHOST |
-			    NI_NUMERICSERV);
-			if (error)
-				continue;
-			fd = socket(res->ai_family, res->ai_socktype,
-			    res->ai_protocol);
-			if (fd < 0)
-				continue;
-			if (connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
-				close(fd);
-				fd = -1;
-				continue;
-			}
+/*
+ * Scheduler
+ *
+ * Coroutines spawned on a scheduler run until a socket operation on a
+ * non-blocking socket would block.  The operation then yields to the
+ * scheduler, which resumes the coroutine when the descriptor is ready or
+ * the timeout of the operation expired.  The first uservalue of the
+ * scheduler maps task numbers to coroutines, the second coroutines to
+ * task numbers.
+ */
+
+static int
+sched_timer_push(struct sched *sc, long long deadline, int task, int gen)
+{
+	struct timer *timers, tm;
+	int n, parent;
+
+	if (sc->ntimers == sc->timersize) {
+		timers = realloc(sc->timers, (sc->timersize ? sc->timersize * 2
+		    : 64) * sizeof(struct timer));
+		if (timers == NULL)
+			return -1;
+		sc->timers = timers;
+		sc->timersize = sc->timersize ? sc->timersize * 2 : 64;
+	}
+
+	tm.deadline = deadline;
+	tm.task = task;
+	tm.gen = gen;
+	for (n = sc->ntimers++; n > 0; n = parent) {
+		parent = (n - 1) / 2;
+		if (sc->timers[parent].deadline <= deadline)
 			break;
-		}
+		sc->timers[n] = sc->timers[parent];
 	}
-	if (fd < 0)
-		return luaL_error(L, "connection error");
-	else {
-		data = (int *)lua_newuserdata(L, sizeof(int *));
-		*data = fd;
-		luaL_getmetatable(L, SOCKET_METATABLE);
-		lua_setmetatable(L, -2);
+	sc->timers[n] = tm;
+	return 0;
+}
+
+static void
+sched_timer_pop(struct sched *sc)
+{
+	struct timer last;
+	int n, child;
+
+	last = sc->timers[--sc->ntimers];
+	for (n = 0; (child = 2 * n + 1) < sc->ntimers; n = child) {
+		if (child + 1 < sc->ntimers && sc->timers[child + 1].deadline
+		    < sc->timers[child].deadline)
+			child++;
+		if (last.deadline <= sc->timers[child].deadline)
+			break;
+		sc->timers[n] = sc->timers[child];
 	}
-	return 1;
+	if (sc->ntimers > 0)
+		sc->timers[n] = last;
 }
 
 static int
-luanet_printf(int fd, const char *fmt, ...)
+sched_ready(struct sched *sc, int task)
 {
-	va_list ap;
-	int len, nwritten;
-	char *text;
+	int *ready;
 
-	va_start(ap, fmt);
-	len = vasprintf(&text, fmt, ap);
-	va_end(ap);
-	if (len == -1) {
-		fprintf(stderr, "vasprintf failed");
-		return -1;
+	if (sc->nready == sc->readysize) {
+		ready = realloc(sc->ready, (sc->readysize ? sc->readysize * 2
+		    : 64) * sizeof(int));
+		if (ready == NULL)
+			return -1;
+		sc->ready = ready;
+		sc->readysize = sc->readysize ? sc->readysize * 2 : 64;
 	}
-
-	nwritten = write(fd, text, len);
-	free(text);
-	return nwritten;
+	sc->ready[sc->nready++] = task;
+	return 0;
 }
 
+/* Tell epoll which events the coroutines waiting for fd are interested in */
 static int
-luanet_print(lua_State *L)
+sched_update(struct sched *sc, int fd)
 {
-	const char *p;
+	struct fdwait *w = &sc->fds[fd];
+	struct epoll_event ev;
 
-	p = luaL_checkstring(L, 2);
-	if (luanet_printf(*(int *)luaL_checkudata(L, 1, SOCKET_METATABLE),
-	    "%s\n", p) < 0)
-		return luaL_error(L, "error printing data");
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (w->reader != -1 ? EPOLLIN : 0)
+	    | (w->writer != -1 ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+
+	if (ev.events == 0) {
+		if (w->registered)
+			epoll_ctl(sc->epfd, EPOLL_CTL_DEL, fd, NULL);
+		w->registered = 0;
+		return 0;
+	}
+
+	/* the descriptor may have been closed and reused meanwhile */
+	if (epoll_ctl(sc->epfd, w->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+	    fd, &ev) == -1 && epoll_ctl(sc->epfd, errno == ENOENT ?
+	    EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) == -1)
+		return -1;
+	w->registered = 1;
 	return 0;
 }
 
-static int
-luanet_read(lua_State *L)
+static lua_State *
+sched_thread(lua_State *L, int task)
 {
-	size_t len, nread;
-	int sock;
-	int timeout;
-	char *buf;
+	lua_State *co;
 
-	len = luaL_checkinteger(L, 2);
-	sock = *(int *)luaL_checkudata(L, 1, SOCKET_METATABLE);
+	lua_getiuservalue(L, 1, 1);
+	lua_rawgeti(L, -1, task);
+	co = lua_tothread(L, -1);
+	lua_pop(L, 2);
+	return co;
+}
 
-	if (lua_gettop(L) > 2)
-		timeout = luaL_checkinteger(L, 3);
-	else
-		timeout = -1;
+/* Make a waiting task ready, timedout is passed to its continuation */
+static int
+sched_wake(lua_State *L, struct sched *sc, int task, int timedout)
+{
+	struct task *t = &sc->tasks[task];
+	struct fdwait *w;
 
-	buf = malloc(len);
-	if (buf == NULL)
-		lua_pushnil(L);
-	else {
-		nread = to_read(sock, buf, len, timeout);
-		if (nread > 0)
-			lua_pushlstring(L, buf, nread);
-		else
-			lua_pushnil(L);
-		free(buf);
+	if (t->fd >= 0) {
+		w = &sc->fds[t->fd];
+		if (w->reader == task)
+			w->reader = -1;
+		if (w->writer == task)
+			w->writer = -1;
+		sched_update(sc, t->fd);
+		t->fd = -1;
 	}
-	return 1;
+
+	/* invalidate pending timers */
+	t->gen++;
+	lua_pushboolean(sched_thread(L, task), timedout);
+	t->nargs = 1;
+	return sched_ready(sc, task);
 }
 
+/* Suspend a task, returns -1 with an error message on the stack on error */
 static int
-luanet_readln(lua_State *L)
+sched_wait(lua_State *L, struct sched *sc, int task, int fd, int events,
+    int ms)
 {
-	size_t len;
-	int timeout_ms;
-	char *buf;
+	struct task *t = &sc->tasks[task];
+	struct fdwait *fds;
+	int *slot, n;
 
-	if (lua_gettop(L) == 2)
-		timeout_ms = luaL_checkinteger(L, 2);
-	else
-		timeout_ms = -1;
+	if (fd >= 0) {
+		if (fd >= sc->nfds) {
+			fds = realloc(sc->fds, (fd + 64) * sizeof(struct fdwait));
+			if (fds == NULL) {
+				lua_pushliteral(L, "memory error");
+				return -1;
+			}
+			for (n = sc->nfds; n < fd + 64; n++) {
+				fds[n].reader = fds[n].writer = -1;
+				fds[n].registered = 0;
+			}
+			sc->fds = fds;
+			sc->nfds = fd + 64;
+		}
+		slot = events & POLLOUT ? &sc->fds[fd].writer
+		    : &sc->fds[fd].reader;
+		if (*slot != -1) {
+			lua_pushfstring(L, "descriptor %d is waited for by "
+			    "two coroutines", fd);
+			return -1;
+		}
+		*slot = task;
+		t->fd = fd;
+		if (sched_update(sc, fd)) {
+			/* let the operation time out */
+			sched_wake(L, sc, task, 1);
+			return 0;
+		}
+	}
 
-	len = asreadln(*(int *)luaL_checkudata(L, 1, SOCKET_METATABLE), &buf,
-	    timeout_ms);
-	if (len > 0)
-		lua_pushstring(L, buf);
-	else
-		lua_pushnil(L);
-	free(buf);
-	return 1;
+	if (ms >= 0) {
+		if (sched_timer_push(sc, sock_now() + ms, task, t->gen)) {
+			lua_pushliteral(L, "memory error");
+			return -1;
+		}
+	} else if (fd < 0 && sched_wake(L, sc, task, 0)) {
+		lua_pushliteral(L, "memory error");
+		return -1;
+	}
+	return 0;
 }
 
-static int
-luanet_socket(lua_State *L)
+static void
+sched_exit(lua_State *L, struct sched *sc, int task)
 {
-	lua_pushinteger(L, *(int *)luaL_checkudata(L, 1, SOCKET_METATABLE));
-	return 1;
+	lua_getiuservalue(L, 1, 2);
+	lua_getiuservalue(L, 1, 1);
+	lua_rawgeti(L, -1, task);
+	lua_pushnil(L);
+	lua_rawset(L, -4);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, task);
+	lua_pop(L, 2);
+
+	sc->tasks[task].gen++;
+	sc->tasks[task].next = sc->freetask;
+	sc->freetask = task;
+	sc->nlive--;
 }
 
+/*
+ * Resume a task and act on how it stopped.  Returns -1 with an error
+ * message on the stack if the coroutine raised an error or could not be
+ * suspended.
+ */
 static int
-luanet_write(lua_State *L)
+sched_resume(lua_State *L, struct sched *sc, int task)
 {
-	size_t len;
-	const char *p;
+	lua_State *co;
+	int status, nres, nargs, fd, events, ms;
 
-	p = luaL_checklstring(L, 2, &len);
-	if (write(*(int *)luaL_checkudata(L, 1, SOCKET_METATABLE), p, len)
-	    != len)
-		return luaL_error(L, "error writing data");
-	return 0;
+	co = sched_thread(L, task);
+	nargs = sc->tasks[task].nargs;
+	sc->tasks[task].nargs = 0;
+
+	status = lua_resume(co, L, nargs, &nres);
+	switch (status) {
+	case LUA_YIELD:
+		if (nres == 4 && lua_touserdata(co, -4) == &sched_marker) {
+			fd = lua_tointeger(co, -3);
+			events = lua_tointeger(co, -2);
+			ms = lua_tointeger(co, -1);
+			lua_pop(co, nres);
+			return sched_wait(L, sc, task, fd, events, ms);
+		}
+
+		/* a plain coroutine.yield(), run again in the next round */
+		lua_pop(co, nres);
+		if (sched_ready(sc, task)) {
+			lua_pushliteral(L, "memory error");
+			return -1;
+		}
+		return 0;
+	case LUA_OK:
+		lua_pop(co, nres);
+		sched_exit(L, sc, task);
+		return 0;
+	default:
+		sched_exit(L, sc, task);
+		lua_xmove(co, L, 1);
+		return -1;
+	}
 }
 
 static int
-luanet_sendfd(lua_State *L)
+luanet_scheduler(lua_State *L)
 {
-	struct msghdr msg;
-	struct cmsghdr *cmsg;
-	struct iovec iov[1];
-	unsigned char fdbuf[CMSG_SPACE(sizeof(int))];
-	char buf[1];
-	int fd, passfd;
+	struct sched *sc;
 
-	/* XXX allow Lua files to be passed as well */
-	fd = *(int *)luaL_checkudata(L, 1, SOCKET_METATABLE);
-	passfd = *(int *)luaL_checkudata(L, 2, SOCKET_METATABLE);
+	sc = lua_newuserdatauv(L, sizeof(struct sched), 2);
+	memset(sc, 0, sizeof(struct sched));
+	sc->epfd = -1;
+	sc->freetask = -1;
+	luaL_getmetatable(L, SCHED_METATABLE);
+	lua_setmetatable(L, -2);
 
-	buf[0] = 0;
-	iov[0].iov_base = buf;
-	iov[0].iov_len = 1;
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 1);
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 2);
 
-	memset(&msg, 0, sizeof(msg));
+	if ((sc->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		return luaL_error(L, "epoll_create1 failed");
+	return 1;
+}
 
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 1;
+/* Create a coroutine running fn(...) and make it ready */
+static int
+luanet_sched_spawn(lua_State *L)
+{
+	struct sched *sc;
+	struct task *tasks;
+	lua_State *co;
+	int n, nargs, task;
 
-	msg.msg_control = fdbuf;
-	msg.msg_controllen = CMSG_LEN(sizeof(int));
+	sc = luaL_checkudata(L, 1, SCHED_METATABLE);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	nargs = lua_gettop(L) - 2;
 
-	cmsg = CMSG_FIRSTHDR(&msg);
+	if (sc->freetask == -1) {
+		tasks = realloc(sc->tasks, (sc->ntasks ? sc->ntasks * 2 : 64)
+		    * sizeof(struct task));
+		if (tasks == NULL)
+			return luaL_error(L, "memory error");
+		sc->tasks = tasks;
+		for (n = sc->ntasks; n < (sc->ntasks ? sc->ntasks * 2 : 64);
+		    n++) {
+			tasks[n].gen = 0;
+			tasks[n].next = sc->freetask;
+			sc->freetask = n;
+		}
+		sc->ntasks = sc->ntasks ? sc->ntasks * 2 : 64;
+	}
+	task = sc->freetask;
+	sc->freetask = sc->tasks[task].next;
+	sc->tasks[task].fd = -1;
+	sc->tasks[task].nargs = nargs;
+	sc->nlive++;
 
-	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-	cmsg->cmsg_level = SOL_SOCKET;
-	cmsg->cmsg_type = SCM_RIGHTS;
+	co = lua_newthread(L);
+	lua_getiuservalue(L, 1, 1);
+	lua_pushvalue(L, -2);
+	lua_rawseti(L, -2, task);
+	lua_pop(L, 1);
+	lua_getiuservalue(L, 1, 2);
+	lua_pushvalue(L, -2);
+	lua_pushinteger(L, task);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
 
-	*(int *)CMSG_DATA(cmsg) = passfd;
+	for (n = 2; n <= nargs + 2; n++)
+		lua_pushvalue(L, n);
+	lua_xmove(L, co, nargs + 1);
 
-	if (sendmsg(fd, &msg, 0) == -1)
-		return luaL_error(L, "sendmsg failed");
-	return 0;
+	if (sched_ready(sc, task))
+		return luaL_error(L, "memory error");
+	return 1;
 }
 
+/* Run until all coroutines have finished */
 static int
-luanet_recvfd(lua_State *L)
+luanet_sched_run(lua_State *L)
 {
-	struct msghdr msg;
-	struct cmsghdr *cmsg;
-	struct iovec iov[1];
-	unsigned char fdbuf[CMSG_SPACE(sizeof(int))];
-	char buf[16];
-	int fd, *data;
+	struct sched *sc;
+	struct epoll_event events[NET_MAXMSGS];
+	struct fdwait *w;
+	struct timer tm;
+	long long now;
+	int n, nready, nevents, timeout;
 
-	fd = *(int *)luaL_checkudata(L, 1, SOCKET_METATABLE);
+	sc = luaL_checkudata(L, 1, SCHED_METATABLE);
+	if (sc->running)
+		return luaL_error(L, "scheduler is already running");
+	lua_settop(L, 1);
 
-	iov[0].iov_base = buf;
-	iov[0].iov_len = sizeof(buf);
+	/* remember an outer scheduler, this one runs nested within it */
+	lua_getfield(L, LUA_REGISTRYINDEX, SCHED_CURRENT);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, LUA_REGISTRYINDEX, SCHED_CURRENT);
+	sc->running = 1;
 
-	memset(&msg, 0, sizeof(msg));
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 1;
+	while (sc->nlive > 0) {
+		/* tasks made ready meanwhile run in the next round */
+		for (nready = sc->nready, n = 0; n < nready; n++)
+			if (sched_resume(L, sc, sc->ready[n]))
+				break;
+		if (n < nready)
+			nready = n + 1;
+		memmove(sc->ready, sc->ready + nready,
+		    (sc->nready - nready) * sizeof(int));
+		sc->nready -= nready;
+		if (n < nready)
+			goto error;
+		if (sc->nlive == 0)
+			break;
 
-	msg.msg_control = fdbuf;
-	msg.msg_controllen = CMSG_LEN(sizeof(int));
+		if (sc->nready > 0)
+			timeout = 0;
+		else if (sc->ntimers > 0) {
+			now = sock_now();
+			timeout = sc->timers[0].deadline > now ?
+			    sc->timers[0].deadline - now : 0;
+		} else
+			timeout = -1;
 
-	cmsg = CMSG_FIRSTHDR(&msg);
+		nevents = epoll_wait(sc->epfd, events, NET_MAXMSGS, timeout);
+		for (n = 0; n < nevents; n++) {
+			w = &sc->fds[events[n].data.fd];
+			if (w->reader != -1 && events[n].events
+			    & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				sched_wake(L, sc, w->reader, 0);
+			if (w->writer != -1 && events[n].events
+			    & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+				sched_wake(L, sc, w->writer, 0);
+		}
 
-	if (recvmsg(fd, &msg, 0) < 0)
-		return luaL_error(L, "recvmsg failed");
-	data = (int *)lua_newuserdata(L, sizeof(int *));
-	*data = *(int *)CMSG_DATA(cmsg);
-	luaL_getmetatable(L, SOCKET_METATABLE);
-	lua_setmetatable(L, -2);
+		now = sock_now();
+		while (sc->ntimers > 0 && sc->timers[0].deadline <= now) {
+			tm = sc->timers[0];
+			sched_timer_pop(sc);
+			if (tm.gen == sc->tasks[tm.task].gen)
+				sched_wake(L, sc, tm.task,
+				    sc->tasks[tm.task].fd >= 0);
+		}
+	}
 
-	return 1;
+	lua_setfield(L, LUA_REGISTRYINDEX, SCHED_CURRENT);
+	sc->running = 0;
+	return 0;
+
+error:
+	lua_pushvalue(L, 2);
+	lua_setfield(L, LUA_REGISTRYINDEX, SCHED_CURRENT);
+	sc->running = 0;
+	return lua_error(L);
 }
 
 static int
-luanet_isvalid(lua_State *L)
+luanet_sched_close(lua_State *L)
 {
-	int error;
-	socklen_t len = sizeof(error);
-
-	lua_pushboolean(L,
-	    getsockopt(*(int *)luaL_checkudata(L, 1, SOCKET_METATABLE),
-	    SOL_SOCKET, SO_ERROR, &error, &len) == 0 ? 1 : 0);
+	struct sched *sc;
 
-	return 1;
+	sc = luaL_checkudata(L, 1, SCHED_METATABLE);
+	if (sc->running)
+		return luaL_error(L, "scheduler is running");
+	if (sc->epfd >= 0) {
+		close(sc->epfd);
+		sc->epfd = -1;
+	}
+	free(sc->tasks);
+	free(sc->ready);
+	free(sc->timers);
+	free(sc->fds);
+	sc->tasks = NULL;
+	sc->ready = NULL;
+	sc->timers = NULL;
+	sc->fds = NULL;
+	sc->ntasks = sc->nready = sc->readysize = 0;
+	sc->ntimers = sc->timersize = sc->nfds = sc->nlive = 0;
+	sc->freetask = -1;
+	return 0;
 }
 
 static int
-luanet_close(lua_State *L)
+sched_wakeup(lua_State *L)
 {
-	close(*(int *)luaL_checkudata(L, 1, SOCKET_METATABLE));
 	return 0;
 }
 
+/* Sleep, within a scheduler only the calling coroutine is suspended */
 static int
-luanet_clear(lua_State *L)
+luanet_sleep(lua_State *L)
 {
-	int *fd;
+	struct timespec rqt;
+	lua_Integer ms;
 
-	fd = luaL_checkudata(L, 1, SOCKET_METATABLE);
-	if (*fd >= 0)  {
-		close(*fd);
-		*fd = -1;
-	}
+	ms = luaL_checkinteger(L, 1);
+	if (sched_active(L))
+		return sched_block(L, -1, 0, ms, sched_wakeup);
+
+	rqt.tv_sec = ms / 1000;
+	rqt.tv_nsec = (ms % 1000) * 1000000;
+	while (nanosleep(&rqt, &rqt) == -1 && errno == EINTR)
+		;
 	return 0;
 }
 
@@ -481,31 +4630,162 @@ luaopen_linux_sys_socket(lua_State *L)
 	struct luaL_Reg net_methods[] = {
 		{ "bind",	luanet_bind },
 		{ "connect",	luanet_connect },
+		{ "udpbind",	luanet_udpbind },
+		{ "udpconnect",	luanet_udpconnect },
+		{ "socketpair",	luanet_socketpair },
+		{ "inherited",	luanet_inherited },
+		{ "fromfd",	luanet_fromfd },
+		{ "scheduler",	luanet_scheduler },
+		{ "sleep",	luanet_sleep },
+		{ "pool",	luanet_pool },
+		{ "proxy",	luanet_proxy },
+		{ "resolve",	luanet_resolve },
+		{ "lookup",	luanet_lookup },
+		{ "dnsttl",	luanet_dnsttl },
 		{ NULL, NULL }
 	};
 
 	struct luaL_Reg socket_methods[] = {
 		{ "accept",	luanet_accept },
+		{ "accept_many",	luanet_accept_many },
 		{ "close",	luanet_close },
 		{ "print",	luanet_print },
 		{ "read",	luanet_read },
 		{ "readln",	luanet_readln },
+		{ "readlines",	luanet_readlines },
+		{ "read_until",	luanet_read_until },
+		{ "peek",	luanet_peek },
+		{ "pending",	luanet_pending },
 		{ "socket",	luanet_socket },
 		{ "write",	luanet_write },
+		{ "writev",	luanet_writev },
+		{ "send",	luanet_send },
+		{ "recv",	luanet_recv },
+		{ "sendzc",	luanet_sendzc },
+		{ "reapzc",	luanet_reapzc },
+		{ "readinto",	luanet_readinto },
+		{ "writefrom",	luanet_writefrom },
+		{ "read_frame",	luanet_read_frame },
+		{ "read_frames",	luanet_read_frames },
+		{ "write_frame",	luanet_write_frame },
+		{ "framing",	luanet_framing },
+		{ "read_headers",	luanet_read_headers },
+		{ "setstats",	luanet_setstats },
+		{ "stats",	luanet_stats },
+		{ "sendfile",	luanet_sendfile },
+		{ "recvmany",	luanet_recvmany },
+		{ "sendmany",	luanet_sendmany },
 		{ "sendfd",	luanet_sendfd },
 		{ "recvfd",	luanet_recvfd },
+		{ "sendfds",	luanet_sendfds },
+		{ "recvfds",	luanet_recvfds },
+		{ "handoff",	luanet_handoff },
+		{ "takeover",	luanet_takeover },
 		{ "isvalid",	luanet_isvalid },
+		{ "setnonblock",	luanet_setnonblock },
+		{ "deadline",	luanet_deadline },
+		{ "setopt",	luanet_setopt },
+		{ "getopt",	luanet_getopt },
+		{ NULL, NULL }
+	};
+
+	struct luaL_Reg dns_methods[] = {
+		{ "fd",		luanet_dns_fd },
+		{ "result",	luanet_dns_result },
+		{ "close",	luanet_dns_close },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg pool_methods[] = {
+		{ "get",	luanet_pool_get },
+		{ "put",	luanet_pool_put },
+		{ "stats",	luanet_pool_stats },
+		{ "close",	luanet_pool_close },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg sched_methods[] = {
+		{ "spawn",	luanet_sched_spawn },
+		{ "run",	luanet_sched_run },
+		{ "close",	luanet_sched_close },
 		{ NULL, NULL }
 	};
 
 	if (luaL_newmetatable(L, SOCKET_METATABLE)) {
 		luaL_setfuncs(L, socket_methods, 0);
 		lua_pushliteral(L, "__gc");
-		lua_pushcfunction(L, luanet_clear);
+		lua_pushcfunction(L, luanet_close);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__close");
+		lua_pushcfunction(L, luanet_close);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, SCHED_METATABLE)) {
+		luaL_setfuncs(L, sched_methods, 0);
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, luanet_sched_close);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, DNS_METATABLE)) {
+		luaL_setfuncs(L, dns_methods, 0);
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, luanet_dns_close);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__close");
+		lua_pushcfunction(L, luanet_dns_close);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	if (lua_getfield(L, LUA_REGISTRYINDEX, DNS_CACHE) != LUA_TTABLE) {
+		lua_newtable(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, DNS_CACHE);
+	}
+	lua_pop(L, 1);
+
+	if (luaL_newmetatable(L, EYEBALLS_METATABLE)) {
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, eyeballs_gc);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
 		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
 
+	if (luaL_newmetatable(L, POOL_METATABLE)) {
+		luaL_setfuncs(L, pool_methods, 0);
 		lua_pushliteral(L, "__close");
-		lua_pushcfunction(L, luanet_clear);
+		lua_pushcfunction(L, luanet_pool_close);
 		lua_settable(L, -3);
 
 		lua_pushliteral(L, "__index");
@@ -28,7 +28,164 @@
 
 #define SOCKET_METATABLE	"network socket"
 
-/* net.read() max buffer size */
-#define NET_BUFSIZ	1024
+/* Initial size of the per-socket read buffer */
+#define NET_BUFSIZ	16384
+
+/* Default payload size and batch limit for recvmany()/sendmany() */
+#define NET_DGRAMSIZ	2048
+#define NET_MAXMSGS	64
+
+/* Largest UDP payload */
+#define NET_MAXDGRAM	65535
+
+/* Default limits of read_headers() */
+#define NET_MAXHDRSIZE	8192
+#define NET_MAXHDRS	100
+
+/* Accuracy of deadlines on blocking sockets, in milliseconds */
+#define NET_DEADLINESLACK	10
+
+/* Shorter remainders are copied by sendzc(), pinning is not worth it */
+#define NET_ZCMIN	16384
+
+/* Bytes moved per splice() call by proxy() */
+#define NET_SPLICESIZ	65536
+
+/* One direction of a proxy, src is spliced into dst through a pipe */
+struct relay {
+	struct socket	*src;
+	struct socket	*dst;
+	int		 pipe[2];
+	size_t		 inpipe;	/* bytes in the pipe */
+	lua_Integer	 bytes;		/* bytes delivered to dst */
+	int		 eof;		/* src has no more data */
+	int		 shut;		/* dst has been shut down for writing */
+};
+
+/* Most descriptors the kernel passes in one message (SCM_MAX_FD) */
+#define NET_MAXFDS	253
+
+/* First descriptor passed by systemd socket activation */
+#define NET_LISTENFDS	3
+
+/* Connection Attempt Delay (RFC 8305) and limit of concurrent attempts */
+#define NET_CONNDELAY	250
+#define NET_MAXATTEMPTS	16
+
+/* Connection attempts of a connect() in progress */
+#define EYEBALLS_METATABLE	"connection attempts"
+
+/* Resolver cache and asynchronous queries */
+#define DNS_METATABLE	"dns query"
+#define DNS_CACHE	"linux.sys.socket.dnscache"
+
+/* Default lifetime of cached results in ms, sweep interval in stores */
+#define NET_DNSTTL	30000
+#define NET_DNSSWEEP	256
+
+/* Pool of idle outbound connections, keyed by destination */
+#define POOL_METATABLE	"socket pool"
+
+/* Default limit of idle connections per destination */
+#define NET_POOLIDLE	8
+
+struct pool {
+	int		 maxidle;	/* idle connections per destination */
+	long long	 lifetime;	/* ms since connect, -1 for no limit */
+	long long	 idletime;	/* ms since put, -1 for no limit */
+	lua_Integer	 hits;
+	lua_Integer	 misses;
+	lua_Integer	 evicted;	/* closed by limits or health checks */
+};
+
+/* Scheduler for coroutines blocked on sockets */
+#define SCHED_METATABLE	"socket scheduler"
+
+/* Registry field holding the scheduler that is currently running */
+#define SCHED_CURRENT	"linux.sys.socket.scheduler"
+
+/* Returned by socket helpers when the calling coroutine has to yield */
+#define SOCK_WOULDBLOCK	-2
+
+/* Socket userdata, the file descriptor must be the first member */
+struct socket {
+	int	 fd;
+	int	 nonblock;	/* O_NONBLOCK is set */
+	size_t	 wdone;		/* bytes written before a write yielded */
+	char	*rbuf;		/* read buffer, allocated on first use */
+	size_t	 rsize;		/* size of the read buffer */
+	size_t	 rpos;		/* start of unconsumed data */
+	size_t	 rend;		/* end of unconsumed data */
+	int	 framing;	/* frame header, see below */
+	struct sockstats *stats; /* I/O counters if enabled */
+	int	 zerocopy;	/* SO_ZEROCOPY is set */
+	unsigned int zcnext;	/* id of the next zerocopy send */
+	int	 zcpending;	/* zerocopy sends not yet completed */
+	long long deadline;	/* sock_now() when I/O fails, 0 if none */
+	int	 rcvtimeo;	/* SO_RCVTIMEO set for the deadline, in ms */
+	int	 sndtimeo;	/* SO_SNDTIMEO set for the deadline, in ms */
+};
+
+/* Per-socket I/O counters, enabled with setstats() */
+struct sockstats {
+	lua_Integer	 rbytes;
+	lua_Integer	 wbytes;
+	lua_Integer	 reads;		/* receiving system calls */
+	lua_Integer	 writes;	/* sending system calls */
+	lua_Integer	 eagain;	/* calls that would have blocked */
+	lua_Integer	 polls;
+	long long	 polltime;	/* microseconds spent in poll() */
+};
+
+/*
+ * Frames are preceded by their length, either as a 1, 2, 4 or 8 byte
+ * big-endian integer or as an unsigned LEB128 varint (FRAME_VARINT).
+ */
+#define FRAME_VARINT	0
+#define NET_FRAMING	4
+
+/* Default limit of the frame size accepted by read_frame() */
+#define NET_MAXFRAME	(16 * 1024 * 1024)
+
+struct task {
+	int	 gen;		/* wait generation, invalidates stale timers */
+	int	 fd;		/* descriptor waited for or -1 */
+	int	 nargs;		/* number of values for the next resume */
+	int	 next;		/* free list */
+};
+
+struct timer {
+	long long	 deadline;	/* CLOCK_MONOTONIC, milliseconds */
+	int		 task;
+	int		 gen;
+};
+
+/* Coroutines waiting for a descriptor, -1 if none */
+struct fdwait {
+	int	 reader;
+	int	 writer;
+	int	 registered;	/* known to epoll */
+};
+
+struct sched {
+	int		 epfd;
+	int		 running;
+
+	struct task	*tasks;
+	int		 ntasks;
+	int		 freetask;
+	int		 nlive;
+
+	int		*ready;
+	int		 nready;
+	int		 readysize;
+
+	struct timer	*timers;
+	int		 ntimers;
+	int		 timersize;
+
+	struct fdwait	*fds;
+	int		 nfds;
+};
 
 #endif /* __LUASOCKET_H__ */
@@ -0,0 +1,555 @@
+/*
+ * Copyright (c) 2023 - 2025 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* io_uring for Lua */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../sys/socket/luasocket.h"
+#include "luauring.h"
+
+/* uservalues of the ring: operation tags and data pinned for sends */
+#define URING_TAGS	1
+#define URING_PINNED	2
+
+static int
+uring_checkfd(lua_State *L, int n)
+{
+	int *fd;
+
+	if (lua_isinteger(L, n))
+		return lua_tointeger(L, n);
+	if ((fd = luaL_testudata(L, n, SOCKET_METATABLE)) != NULL)
+		return *fd;
+	return luaL_argerror(L, n, "socket or file descriptor expected");
+}
+
+static struct uring *
+uring_checkring(lua_State *L, int n)
+{
+	struct uring *u;
+
+	u = luaL_checkudata(L, n, URING_METATABLE);
+	if (!u->initialized)
+		luaL_error(L, "attempt to use a closed ring");
+	return u;
+}
+
+/*
+ * Make sure that a submission queue entry and an operation slot are
+ * available, raising an error otherwise.  Operations that allocate
+ * resources call this first, so the next uring_prepare() can not fail.
+ */
+static void
+uring_reserve(lua_State *L, struct uring *u)
+{
+	if (u->freeop == -1)
+		luaL_error(L, "too many operations in flight");
+	if (io_uring_sq_space_left(&u->ring) == 0) {
+		/* the submission queue is full, make room */
+		io_uring_submit(&u->ring);
+		if (io_uring_sq_space_left(&u->ring) == 0)
+			luaL_error(L, "submission queue full");
+	}
+}
+
+/*
+ * Get a submission queue entry and an operation slot, and remember the
+ * tag at stack index tag.  Raises an error if either is exhausted.
+ */
+static struct io_uring_sqe *
+uring_prepare(lua_State *L, struct uring *u, enum uring_opcode op, int tag,
+    int *slot)
+{
+	struct io_uring_sqe *sqe;
+
+	uring_reserve(L, u);
+	if ((sqe = io_uring_get_sqe(&u->ring)) == NULL)
+		luaL_error(L, "submission queue full");
+
+	*slot = u->freeop;
+	u->freeop = u->ops[*slot].next;
+	u->ops[*slot].op = op;
+	u->ops[*slot].fd = -1;
+	u->ops[*slot].buf = -1;
+	u->ops[*slot].data = NULL;
+	io_uring_sqe_set_data(sqe, (void *)(uintptr_t)*slot);
+
+	lua_getiuservalue(L, 1, URING_TAGS);
+	lua_pushvalue(L, tag);
+	lua_rawseti(L, -2, *slot);
+	lua_pop(L, 1);
+	return sqe;
+}
+
+static void
+uring_release(lua_State *L, struct uring *u, int slot)
+{
+	struct uring_op *op = &u->ops[slot];
+
+	free(op->data);
+	op->data = NULL;
+	if (op->buf != -1)
+		u->freebufs[u->nfreebufs++] = op->buf;
+	op->op = URING_FREE;
+	op->next = u->freeop;
+	u->freeop = slot;
+
+	lua_getiuservalue(L, 1, URING_TAGS);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, slot);
+	lua_getiuservalue(L, 1, URING_PINNED);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, slot);
+	lua_pop(L, 2);
+}
+
+static int
+linux_uring_new(lua_State *L)
+{
+	struct uring *u;
+	unsigned entries;
+	size_t bufsize;
+	int n, nbufs;
+
+	entries = luaL_optinteger(L, 1, 256);
+	nbufs = luaL_optinteger(L, 2, 0);
+	bufsize = luaL_optinteger(L, 3, 16384);
+
+	u = lua_newuserdatauv(L, sizeof(struct uring), 2);
+	memset(u, 0, sizeof(struct uring));
+	luaL_getmetatable(L, URING_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, URING_TAGS);
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, URING_PINNED);
+
+	if (io_uring_queue_init(entries, &u->ring, 0) < 0) {
+		lua_pushnil(L);
+		return 1;
+	}
+	u->initialized = 1;
+
+	/* as many operations as fit into the completion queue */
+	u->nops = entries * 2;
+	if ((u->ops = calloc(u->nops, sizeof(struct uring_op))) == NULL)
+		return luaL_error(L, "memory error");
+	for (n = 0; n < u->nops; n++)
+		u->ops[n].next = n + 1 < u->nops ? n + 1 : -1;
+	u->freeop = 0;
+
+	if (nbufs > 0) {
+		u->bufs = calloc(nbufs, sizeof(struct iovec));
+		u->freebufs = calloc(nbufs, sizeof(int));
+		if (u->bufs == NULL || u->freebufs == NULL)
+			return luaL_error(L, "memory error");
+		for (n = 0; n < nbufs; n++) {
+			if ((u->bufs[n].iov_base = malloc(bufsize)) == NULL)
+				return luaL_error(L, "memory error");
+			u->bufs[n].iov_len = bufsize;
+			u->freebufs[n] = n;
+			u->nbufs = u->nfreebufs = n + 1;
+		}
+		if (io_uring_register_buffers(&u->ring, u->bufs, nbufs) < 0)
+			return luaL_error(L, "can't register buffers");
+	}
+	return 1;
+}
+
+static int
+linux_uring_accept(lua_State *L)
+{
+	struct uring *u;
+	struct io_uring_sqe *sqe;
+	int fd, slot;
+
+	u = uring_checkring(L, 1);
+	fd = uring_checkfd(L, 2);
+	sqe = uring_prepare(L, u, URING_ACCEPT, 3, &slot);
+	io_uring_prep_accept(sqe, fd, NULL, NULL, SOCK_CLOEXEC);
+	return 0;
+}
+
+static int
+linux_uring_recv(lua_State *L)
+{
+	struct uring *u;
+	struct io_uring_sqe *sqe;
+	size_t len;
+	char *buf;
+	int fd, slot;
+
+	u = uring_checkring(L, 1);
+	fd = uring_checkfd(L, 2);
+	len = luaL_checkinteger(L, 3);
+	uring_reserve(L, u);
+	if ((buf = malloc(len)) == NULL)
+		return luaL_error(L, "memory error");
+	sqe = uring_prepare(L, u, URING_RECV, 4, &slot);
+	u->ops[slot].data = buf;
+	io_uring_prep_recv(sqe, fd, buf, len, 0);
+	return 0;
+}
+
+static int
+linux_uring_send(lua_State *L)
+{
+	struct uring *u;
+	struct io_uring_sqe *sqe;
+	const char *data;
+	size_t len;
+	int fd, slot;
+
+	u = uring_checkring(L, 1);
+	fd = uring_checkfd(L, 2);
+	data = luaL_checklstring(L, 3, &len);
+	sqe = uring_prepare(L, u, URING_SEND, 4, &slot);
+
+	/* keep the string alive until the send completes */
+	lua_getiuservalue(L, 1, URING_PINNED);
+	lua_pushvalue(L, 3);
+	lua_rawseti(L, -2, slot);
+	lua_pop(L, 1);
+
+	io_uring_prep_send(sqe, fd, data, len, MSG_NOSIGNAL);
+	return 0;
+}
+
+/*
+ * Connect a new socket to host and port.  The completion carries the
+ * socket descriptor in fd if the connection was established.
+ */
+static int
+linux_uring_connect(lua_State *L)
+{
+	struct uring *u;
+	struct io_uring_sqe *sqe;
+	struct addrinfo hints, *res;
+	struct uring_op *op;
+	const char *host, *port;
+	int fd, slot, error;
+
+	u = uring_checkring(L, 1);
+	host = luaL_checkstring(L, 2);
+	port = luaL_checkstring(L, 3);
+	uring_reserve(L, u);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	error = getaddrinfo(host, port, &hints, &res);
+	if (error)
+		return luaL_error(L, "%s: %s", host, gai_strerror(error));
+	fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC,
+	    res->ai_protocol);
+	if (fd == -1) {
+		freeaddrinfo(res);
+		return luaL_error(L, "socket error");
+	}
+
+	sqe = uring_prepare(L, u, URING_CONNECT, 4, &slot);
+	op = &u->ops[slot];
+	op->fd = fd;
+	memcpy(&op->addr, res->ai_addr, res->ai_addrlen);
+	io_uring_prep_connect(sqe, fd, (struct sockaddr *)&op->addr,
+	    res->ai_addrlen);
+	freeaddrinfo(res);
+	return 0;
+}
+
+static int
+linux_uring_splice(lua_State *L)
+{
+	struct uring *u;
+	struct io_uring_sqe *sqe;
+	int fd_in, fd_out, slot;
+	unsigned len;
+
+	u = uring_checkring(L, 1);
+	fd_in = uring_checkfd(L, 2);
+	fd_out = uring_checkfd(L, 3);
+	len = luaL_checkinteger(L, 4);
+	sqe = uring_prepare(L, u, URING_SPLICE, 5, &slot);
+	io_uring_prep_splice(sqe, fd_in, -1, fd_out, -1, len,
+	    SPLICE_F_MOVE);
+	return 0;
+}
+
+static int
+linux_uring_timeout(lua_State *L)
+{
+	struct uring *u;
+	struct io_uring_sqe *sqe;
+	lua_Integer ms;
+	int slot;
+
+	u = uring_checkring(L, 1);
+	ms = luaL_checkinteger(L, 2);
+	sqe = uring_prepare(L, u, URING_TIMEOUT, 3, &slot);
+	u->ops[slot].ts.tv_sec = ms / 1000;
+	u->ops[slot].ts.tv_nsec = (ms % 1000) * 1000000;
+	io_uring_prep_timeout(sqe, &u->ops[slot].ts, 0, 0);
+	return 0;
+}
+
+static int
+uring_getbuf(lua_State *L, struct uring *u)
+{
+	if (u->nfreebufs == 0)
+		return luaL_error(L, "no registered buffer available");
+	return u->freebufs[--u->nfreebufs];
+}
+
+/* Read into one of the registered buffers */
+static int
+linux_uring_read_fixed(lua_State *L)
+{
+	struct uring *u;
+	struct io_uring_sqe *sqe;
+	int fd, slot, buf;
+
+	u = uring_checkring(L, 1);
+	fd = uring_checkfd(L, 2);
+	uring_reserve(L, u);
+	buf = uring_getbuf(L, u);
+	sqe = uring_prepare(L, u, URING_READ_FIXED, 3, &slot);
+	u->ops[slot].buf = buf;
+	io_uring_prep_read_fixed(sqe, fd, u->bufs[buf].iov_base,
+	    u->bufs[buf].iov_len, 0, buf);
+	return 0;
+}
+
+/* Copy data into one of the registered buffers and write it */
+static int
+linux_uring_write_fixed(lua_State *L)
+{
+	struct uring *u;
+	struct io_uring_sqe *sqe;
+	const char *data;
+	size_t len;
+	int fd, slot, buf;
+
+	u = uring_checkring(L, 1);
+	fd = uring_checkfd(L, 2);
+	data = luaL_checklstring(L, 3, &len);
+	uring_reserve(L, u);
+	buf = uring_getbuf(L, u);
+	if (len > u->bufs[buf].iov_len) {
+		u->freebufs[u->nfreebufs++] = buf;
+		return luaL_argerror(L, 3, "data exceeds buffer size");
+	}
+	memcpy(u->bufs[buf].iov_base, data, len);
+	sqe = uring_prepare(L, u, URING_WRITE_FIXED, 4, &slot);
+	u->ops[slot].buf = buf;
+	io_uring_prep_write_fixed(sqe, fd, u->bufs[buf].iov_base, len, 0,
+	    buf);
+	return 0;
+}
+
+static int
+linux_uring_submit(lua_State *L)
+{
+	lua_pushinteger(L, io_uring_submit(&uring_checkring(L, 1)->ring));
+	return 1;
+}
+
+/* Push a completion as a table with tag, res and optional data or fd */
+static void
+uring_complete(lua_State *L, struct uring *u, struct io_uring_cqe *cqe)
+{
+	struct uring_op *op;
+	int slot;
+
+	slot = (uintptr_t)io_uring_cqe_get_data(cqe);
+	op = &u->ops[slot];
+
+	lua_createtable(L, 0, 3);
+	lua_getiuservalue(L, 1, URING_TAGS);
+	lua_rawgeti(L, -1, slot);
+	lua_setfield(L, -3, "tag");
+	lua_pop(L, 1);
+	lua_pushinteger(L, cqe->res);
+	lua_setfield(L, -2, "res");
+
+	switch (op->op) {
+	case URING_RECV:
+		if (cqe->res > 0) {
+			lua_pushlstring(L, op->data, cqe->res);
+			lua_setfield(L, -2, "data");
+		}
+		break;
+	case URING_READ_FIXED:
+		if (cqe->res > 0) {
+			lua_pushlstring(L, u->bufs[op->buf].iov_base,
+			    cqe->res);
+			lua_setfield(L, -2, "data");
+		}
+		break;
+	case URING_CONNECT:
+		if (cqe->res == 0) {
+			lua_pushinteger(L, op->fd);
+			lua_setfield(L, -2, "fd");
+		} else
+			close(op->fd);
+		break;
+	default:
+		break;
+	}
+	uring_release(L, u, slot);
+}
+
+/*
+ * Submit all prepared operations and wait for at least min completions
+ * (default 1) or until the timeout in milliseconds expires.  Returns all
+ * available completions as an array.
+ */
+static int
+linux_uring_wait(lua_State *L)
+{
+	struct uring *u;
+	struct io_uring_cqe *cqes[URING_BATCH], *cqe;
+	struct __kernel_timespec ts;
+	lua_Integer ms;
+	unsigned min, n, ncqes;
+	int r, ncompleted;
+
+	u = uring_checkring(L, 1);
+	min = luaL_optinteger(L, 2, 1);
+	ms = luaL_optinteger(L, 3, -1);
+
+	if (ms >= 0) {
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000;
+		io_uring_submit(&u->ring);
+		r = io_uring_wait_cqes(&u->ring, &cqe, min, &ts, NULL);
+	} else
+		r = io_uring_submit_and_wait(&u->ring, min);
+	if (r < 0 && r != -ETIME && r != -EINTR) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(-r));
+		return 2;
+	}
+
+	lua_newtable(L);
+	ncompleted = 0;
+	while ((ncqes = io_uring_peek_batch_cqe(&u->ring, cqes,
+	    URING_BATCH)) > 0) {
+		for (n = 0; n < ncqes; n++) {
+			uring_complete(L, u, cqes[n]);
+			lua_rawseti(L, -2, ++ncompleted);
+		}
+		io_uring_cq_advance(&u->ring, ncqes);
+	}
+	return 1;
+}
+
+static int
+linux_uring_close(lua_State *L)
+{
+	struct uring *u;
+	int n;
+
+	u = luaL_checkudata(L, 1, URING_METATABLE);
+	if (u->initialized) {
+		io_uring_queue_exit(&u->ring);
+		u->initialized = 0;
+	}
+	if (u->ops != NULL) {
+		for (n = 0; n < u->nops; n++) {
+			free(u->ops[n].data);
+			if (u->ops[n].op == URING_CONNECT)
+				close(u->ops[n].fd);
+		}
+		free(u->ops);
+		u->ops = NULL;
+	}
+	if (u->bufs != NULL) {
+		for (n = 0; n < u->nbufs; n++)
+			free(u->bufs[n].iov_base);
+		free(u->bufs);
+		u->bufs = NULL;
+	}
+	free(u->freebufs);
+	u->freebufs = NULL;
+	return 0;
+}
+
+int
+luaopen_linux_uring(lua_State *L)
+{
+	struct luaL_Reg lualinuxuring[] = {
+		{ "new",	linux_uring_new },
+		{ NULL, NULL }
+	};
+	struct luaL_Reg uring_methods[] = {
+		{ "accept",	linux_uring_accept },
+		{ "recv",	linux_uring_recv },
+		{ "send",	linux_uring_send },
+		{ "connect",	linux_uring_connect },
+		{ "splice",	linux_uring_splice },
+		{ "timeout",	linux_uring_timeout },
+		{ "read_fixed",	linux_uring_read_fixed },
+		{ "write_fixed",	linux_uring_write_fixed },
+		{ "submit",	linux_uring_submit },
+		{ "wait",	linux_uring_wait },
+		{ "close",	linux_uring_close },
+		{ NULL,		NULL }
+	};
+
+	if (luaL_newmetatable(L, URING_METATABLE)) {
+		luaL_setfuncs(L, uring_methods, 0);
+
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, linux_uring_close);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__close");
+		lua_pushcfunction(L, linux_uring_close);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, -2);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "must not access this metatable");
+		lua_settable(L, -3);
+	}
+	lua_pop(L, 1);
+
+	luaL_newlib(L, lualinuxuring);
+	return 1;
+}
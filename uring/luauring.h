@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2023 - 2025 Micro Systems Marc Balmer, CH-5073 Gipf-Oberfrick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* io_uring for Lua */
+
+#ifndef __LUAURING_H__
+#define __LUAURING_H__
+
+#define URING_METATABLE		"io_uring instance"
+
+/* Number of completions fetched from the ring at once */
+#define URING_BATCH		64
+
+enum uring_opcode {
+	URING_FREE = 0,
+	URING_ACCEPT,
+	URING_RECV,
+	URING_SEND,
+	URING_CONNECT,
+	URING_SPLICE,
+	URING_TIMEOUT,
+	URING_READ_FIXED,
+	URING_WRITE_FIXED
+};
+
+/*
+ * An operation in flight.  The kernel may access addr, addrlen and ts
+ * until the operation completes, so operations are never moved.
+ */
+struct uring_op {
+	enum uring_opcode	 op;
+	int			 next;		/* free list */
+	int			 fd;		/* socket created by connect */
+	int			 buf;		/* fixed buffer index */
+	char			*data;		/* receive buffer */
+	struct sockaddr_storage	 addr;
+	struct __kernel_timespec ts;
+};
+
+struct uring {
+	struct io_uring		 ring;
+	int			 initialized;
+	struct uring_op		*ops;
+	int			 nops;
+	int			 freeop;
+
+	/* registered buffers */
+	struct iovec		*bufs;
+	int			*freebufs;
+	int			 nbufs;
+	int			 nfreebufs;
+};
+
+#endif /* __LUAURING_H__ */